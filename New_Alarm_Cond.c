@@ -37,215 +37,1159 @@ void stop_reading() {
   sem_post(&alarm_read_semaphore);
 }
 
+/*
+ * Heap order: earlier expiration first, ties broken by alarm id so the
+ * expiry order is deterministic.
+ */
+static int deadline_before(alarm_t *a, alarm_t *b) {
+  if (a->expiration != b->expiration) {
+    return a->expiration < b->expiration;
+  }
+  return a->alarm_id < b->alarm_id;
+}
+
+static void deadline_heap_swap(int i, int j) {
+  alarm_t *tmp = deadline_heap[i];
+  deadline_heap[i] = deadline_heap[j];
+  deadline_heap[j] = tmp;
+  deadline_heap[i]->heap_index = i;
+  deadline_heap[j]->heap_index = j;
+}
+
+static void deadline_heap_sift_up(int i) {
+  while (i > 0 && deadline_before(deadline_heap[i], deadline_heap[(i - 1) / 2])) {
+    deadline_heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void deadline_heap_sift_down(int i) {
+  while (1) {
+    int smallest = i;
+    int left = 2 * i + 1, right = 2 * i + 2;
+    if (left < deadline_heap_size &&
+        deadline_before(deadline_heap[left], deadline_heap[smallest])) {
+      smallest = left;
+    }
+    if (right < deadline_heap_size &&
+        deadline_before(deadline_heap[right], deadline_heap[smallest])) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    deadline_heap_swap(i, smallest);
+    i = smallest;
+  }
+}
+
+void deadline_heap_push(alarm_t *alarm) {
+  if (deadline_heap_size == deadline_heap_capacity) {
+    // Grow the heap array, doubling keeps inserts amortized constant
+    int capacity = deadline_heap_capacity ? deadline_heap_capacity * 2 : 16;
+    alarm_t **heap = realloc(deadline_heap, capacity * sizeof(alarm_t *));
+    if (heap == NULL)
+      errno_abort("Allocate deadline heap");
+    deadline_heap = heap;
+    deadline_heap_capacity = capacity;
+  }
+  alarm->heap_index = deadline_heap_size;
+  deadline_heap[deadline_heap_size++] = alarm;
+  deadline_heap_sift_up(alarm->heap_index);
+}
+
+void deadline_heap_remove(alarm_t *alarm) {
+  int i = alarm->heap_index;
+
+  deadline_heap_size--;
+  if (i != deadline_heap_size) {
+    // Move the last alarm into the hole and restore the order around it
+    deadline_heap[i] = deadline_heap[deadline_heap_size];
+    deadline_heap[i]->heap_index = i;
+    deadline_heap_update(deadline_heap[i]);
+  }
+  alarm->heap_index = -1;
+}
+
+void deadline_heap_update(alarm_t *alarm) {
+  deadline_heap_sift_up(alarm->heap_index);
+  deadline_heap_sift_down(alarm->heap_index);
+}
+
+/*
+ * The id skip list uses alarm->link as level 0, so alarm_list stays the
+ * sorted list the display threads walk. A NULL alarm stands for the head.
+ */
+static alarm_t **skip_link(alarm_t *alarm, int level) {
+  if (alarm == NULL) {
+    return level == 0 ? &alarm_list : &alarm_skip_head[level];
+  }
+  return level == 0 ? &alarm->link : &alarm->skip[level];
+}
+
+/*
+ * Find, on every level, the link pointing at the first alarm whose id is not
+ * below alarm_id.
+ */
+static void alarm_index_search(int alarm_id, alarm_t **update[]) {
+  alarm_t *node = NULL, *next;
+  int level;
+
+  for (level = ALARM_SKIP_LEVELS - 1; level >= 0; level--) {
+    while ((next = *skip_link(node, level)) != NULL &&
+           next->alarm_id < alarm_id) {
+      node = next;
+    }
+    update[level] = skip_link(node, level);
+  }
+}
+
+alarm_t *alarm_index_lower_bound(int alarm_id) {
+  alarm_t **update[ALARM_SKIP_LEVELS];
+
+  alarm_index_search(alarm_id, update);
+  return *update[0];
+}
+
+alarm_t *alarm_index_find(int alarm_id) {
+  alarm_t *alarm = alarm_index_lower_bound(alarm_id);
+
+  return (alarm != NULL && alarm->alarm_id == alarm_id) ? alarm : NULL;
+}
+
+int alarm_index_insert(alarm_t *alarm) {
+  alarm_t **update[ALARM_SKIP_LEVELS];
+  int level;
+
+  alarm_index_search(alarm->alarm_id, update);
+  if (*update[0] != NULL && (*update[0])->alarm_id == alarm->alarm_id) {
+    return -1;
+  }
+
+  // Each further level is used with probability 1/4 (xorshift32)
+  alarm->skip_levels = 1;
+  while (alarm->skip_levels < ALARM_SKIP_LEVELS) {
+    alarm_skip_seed ^= alarm_skip_seed << 13;
+    alarm_skip_seed ^= alarm_skip_seed >> 17;
+    alarm_skip_seed ^= alarm_skip_seed << 5;
+    if ((alarm_skip_seed & 3) != 0) {
+      break;
+    }
+    alarm->skip_levels++;
+  }
+
+  for (level = 0; level < alarm->skip_levels; level++) {
+    *skip_link(alarm, level) = *update[level];
+    *update[level] = alarm;
+  }
+  return 0;
+}
+
+void alarm_index_remove(alarm_t *alarm) {
+  alarm_t **update[ALARM_SKIP_LEVELS];
+  int level;
+
+  alarm_index_search(alarm->alarm_id, update);
+  for (level = 0; level < alarm->skip_levels; level++) {
+    *update[level] = *skip_link(alarm, level);
+  }
+}
+
+alarm_group_t *group_index_find(int group) {
+  alarm_group_t *entry = group_table[group % GROUP_TABLE_SIZE];
+
+  while (entry != NULL && entry->group != group) {
+    entry = entry->next;
+  }
+  return entry;
+}
+
+void group_index_insert(alarm_t *alarm) {
+  alarm_group_t *entry = group_index_find(alarm->group);
+  alarm_t *prev = NULL, *next;
+
+  if (entry == NULL) {
+    // First alarm of the group, add the group to its bucket
+    entry = malloc(sizeof(alarm_group_t));
+    if (entry == NULL)
+      errno_abort("Allocate alarm group");
+    entry->group = alarm->group;
+    entry->count = 0;
+    entry->alarms = NULL;
+    entry->last = NULL;
+    entry->next = group_table[alarm->group % GROUP_TABLE_SIZE];
+    group_table[alarm->group % GROUP_TABLE_SIZE] = entry;
+  }
+
+  // Keep the group sorted by id so it can be listed in pages. Ids mostly
+  // grow, so try the end of the group before walking it.
+  if (entry->last != NULL && entry->last->alarm_id < alarm->alarm_id) {
+    prev = entry->last;
+    next = NULL;
+  } else {
+    next = entry->alarms;
+    while (next != NULL && next->alarm_id < alarm->alarm_id) {
+      prev = next;
+      next = next->group_next;
+    }
+  }
+  alarm->group_prev = prev;
+  alarm->group_next = next;
+  if (prev != NULL) {
+    prev->group_next = alarm;
+  } else {
+    entry->alarms = alarm;
+  }
+  if (next != NULL) {
+    next->group_prev = alarm;
+  } else {
+    entry->last = alarm;
+  }
+  entry->count++;
+}
+
+void group_index_remove(alarm_t *alarm) {
+  alarm_group_t **link = &group_table[alarm->group % GROUP_TABLE_SIZE];
+  alarm_group_t *entry;
+
+  while ((*link)->group != alarm->group) {
+    link = &(*link)->next;
+  }
+  entry = *link;
+
+  if (alarm->group_prev != NULL) {
+    alarm->group_prev->group_next = alarm->group_next;
+  } else {
+    entry->alarms = alarm->group_next;
+  }
+  if (alarm->group_next != NULL) {
+    alarm->group_next->group_prev = alarm->group_prev;
+  } else {
+    entry->last = alarm->group_prev;
+  }
+  // Free the group once its last alarm is gone
+  if (--entry->count == 0) {
+    *link = entry->next;
+    free(entry);
+  }
+}
+
+static void copy_alarm_summary(alarm_summary_t *summary, alarm_t *alarm) {
+  summary->alarm_id = alarm->alarm_id;
+  summary->group = alarm->group;
+  summary->seconds = alarm->seconds;
+  summary->expiration = alarm->expiration;
+  strcpy(summary->message, alarm->message);
+}
+
+static void print_alarm_page(alarm_summary_t *page, int count) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    printf("Alarm(%d) Listed by Main Thread %lu at %ld: Group(%d) %d %s "
+           "Expires at %ld\n",
+           page[i].alarm_id, pthread_self(), clock_now(), page[i].group,
+           page[i].seconds, page[i].message, page[i].expiration);
+  }
+}
+
+static void print_list_end(int total, int pages) {
+  printf("Listed %d Alarms in %d Pages by Main Thread %lu at %ld\n", total,
+         pages, pthread_self(), clock_now());
+}
+
+void list_alarms_by_id(int first_id, int last_id) {
+  alarm_summary_t page[LIST_PAGE_SIZE];
+  alarm_t *alarm;
+  int count, total = 0, pages = 0, next_id = first_id;
+
+  do {
+    // Copy one page while reading, print it after letting writers back in
+    count = 0;
+    start_reading();
+    for (alarm = alarm_index_lower_bound(next_id);
+         alarm != NULL && alarm->alarm_id <= last_id && count < LIST_PAGE_SIZE;
+         alarm = alarm->link) {
+      copy_alarm_summary(&page[count++], alarm);
+    }
+    stop_reading();
+    print_alarm_page(page, count);
+    total += count;
+    pages++;
+    if (count > 0) {
+      next_id = page[count - 1].alarm_id;
+    }
+  } while (count == LIST_PAGE_SIZE && next_id++ < last_id);
+  print_list_end(total, pages);
+}
+
+void list_alarms_by_group(int group) {
+  alarm_summary_t page[LIST_PAGE_SIZE];
+  alarm_group_t *entry;
+  alarm_t *alarm;
+  int count, total = 0, pages = 0, last_id = -1;
+
+  do {
+    count = 0;
+    start_reading();
+    entry = group_index_find(group);
+    alarm = entry != NULL ? entry->alarms : NULL;
+    if (last_id >= 0) {
+      // Resume after the last listed alarm, directly if it is still there
+      alarm_t *last = alarm_index_find(last_id);
+      if (last != NULL && last->group == group) {
+        alarm = last->group_next;
+      } else {
+        while (alarm != NULL && alarm->alarm_id <= last_id) {
+          alarm = alarm->group_next;
+        }
+      }
+    }
+    for (; alarm != NULL && count < LIST_PAGE_SIZE; alarm = alarm->group_next) {
+      copy_alarm_summary(&page[count++], alarm);
+    }
+    stop_reading();
+    print_alarm_page(page, count);
+    total += count;
+    pages++;
+    if (count > 0) {
+      last_id = page[count - 1].alarm_id;
+    }
+  } while (count == LIST_PAGE_SIZE);
+  print_list_end(total, pages);
+}
+
+/* Deadline order used by the expiring list: expiration, then id */
+static int summary_after(time_t expiration, int alarm_id, time_t after_time,
+                         int after_id) {
+  return expiration > after_time ||
+         (expiration == after_time && alarm_id > after_id);
+}
+
+/*
+ * Collect into page, sorted, the earliest alarms of the heap subtree at i
+ * that expire by end and come after the cursor. A subtree is skipped once its
+ * root expires after end or after everything a full page already holds,
+ * since no alarm below it can expire earlier.
+ */
+static void collect_deadline_page(int i, time_t end, time_t after_time,
+                                  int after_id, alarm_summary_t *page,
+                                  int *count) {
+  alarm_t *alarm;
+  int slot;
+
+  if (i >= deadline_heap_size) {
+    return;
+  }
+  alarm = deadline_heap[i];
+  if (alarm->expiration > end) {
+    return;
+  }
+  if (*count == LIST_PAGE_SIZE &&
+      !summary_after(page[*count - 1].expiration, page[*count - 1].alarm_id,
+                     alarm->expiration, alarm->alarm_id)) {
+    return;
+  }
+  if (summary_after(alarm->expiration, alarm->alarm_id, after_time,
+                    after_id)) {
+    // Insertion into the sorted page, dropping its last entry if full
+    slot = *count < LIST_PAGE_SIZE ? (*count)++ : LIST_PAGE_SIZE - 1;
+    while (slot > 0 &&
+           summary_after(page[slot - 1].expiration, page[slot - 1].alarm_id,
+                         alarm->expiration, alarm->alarm_id)) {
+      page[slot] = page[slot - 1];
+      slot--;
+    }
+    copy_alarm_summary(&page[slot], alarm);
+  }
+  collect_deadline_page(2 * i + 1, end, after_time, after_id, page, count);
+  collect_deadline_page(2 * i + 2, end, after_time, after_id, page, count);
+}
+
+void list_alarms_by_deadline(int seconds) {
+  alarm_summary_t page[LIST_PAGE_SIZE];
+  time_t end = clock_now() + seconds;
+  time_t after_time = 0;
+  int count, total = 0, pages = 0, after_id = -1;
+
+  do {
+    count = 0;
+    start_reading();
+    collect_deadline_page(0, end, after_time, after_id, page, &count);
+    stop_reading();
+    print_alarm_page(page, count);
+    total += count;
+    pages++;
+    if (count > 0) {
+      after_time = page[count - 1].expiration;
+      after_id = page[count - 1].alarm_id;
+    }
+  } while (count == LIST_PAGE_SIZE);
+  print_list_end(total, pages);
+}
+
+time_t clock_now() {
+  if (clock_source == CLOCK_SOURCE_REAL) {
+    return time(NULL);
+  }
+  // Read without clock_mutex, every thread due at a tick asks for the time
+  return atomic_load(&virtual_now);
+}
+
+/* Order of the simulated clock's deadline heap */
+static void clock_deadline_swap(int i, int j) {
+  clock_waiter_t *tmp = clock_deadlines[i];
+  clock_deadlines[i] = clock_deadlines[j];
+  clock_deadlines[j] = tmp;
+  clock_deadlines[i]->heap_index = i;
+  clock_deadlines[j]->heap_index = j;
+}
+
+static void clock_deadline_sift(int i) {
+  while (i > 0 &&
+         clock_deadlines[i]->deadline < clock_deadlines[(i - 1) / 2]->deadline) {
+    clock_deadline_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  while (1) {
+    int smallest = i;
+    int left = 2 * i + 1, right = 2 * i + 2;
+    if (left < clock_deadline_count &&
+        clock_deadlines[left]->deadline < clock_deadlines[smallest]->deadline) {
+      smallest = left;
+    }
+    if (right < clock_deadline_count &&
+        clock_deadlines[right]->deadline < clock_deadlines[smallest]->deadline) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    clock_deadline_swap(i, smallest);
+    i = smallest;
+  }
+}
+
+/*
+ * Bucket of the waiters on a semaphore or wakeup word. The address is mixed
+ * first, display contexts are allocated at a fixed stride that would
+ * otherwise leave most buckets empty.
+ */
+static clock_waiter_t **clock_wakeup_bucket(const void *object) {
+  uint64_t hash = (uint64_t)(uintptr_t)object * 0x9E3779B97F4A7C15u;
+
+  return &clock_wakeup_table[(hash >> 32) % CLOCK_WAKEUP_TABLE_SIZE];
+}
+
+/*
+ * Add a waiter to the deadline heap and to the bucket of what it waits on, or
+ * to the idle waiters if nothing but clock_wait_idle can end its wait.
+ * Called with clock_mutex held.
+ */
+static void clock_waiter_add(clock_waiter_t *waiter) {
+  clock_waiter_t **bucket;
+
+  waiter->heap_index = -1;
+  if (waiter->deadline != CLOCK_NEVER) {
+    if (clock_deadline_count == clock_deadline_capacity) {
+      int capacity = clock_deadline_capacity ? clock_deadline_capacity * 2 : 16;
+      clock_waiter_t **heap =
+          realloc(clock_deadlines, capacity * sizeof(clock_waiter_t *));
+      if (heap == NULL)
+        errno_abort("Allocate clock deadlines");
+      clock_deadlines = heap;
+      clock_deadline_capacity = capacity;
+    }
+    waiter->heap_index = clock_deadline_count;
+    clock_deadlines[clock_deadline_count++] = waiter;
+    clock_deadline_sift(waiter->heap_index);
+  }
+  if (waiter->sem != NULL || waiter->word != NULL) {
+    bucket = clock_wakeup_bucket(waiter->sem != NULL ? (void *)waiter->sem
+                                                     : (void *)waiter->word);
+  } else if (waiter->deadline == CLOCK_NEVER) {
+    bucket = &clock_idle_waiters;
+  } else {
+    return;
+  }
+  waiter->next = *bucket;
+  *bucket = waiter;
+}
+
+/* Undo clock_waiter_add. Called with clock_mutex held. */
+static void clock_waiter_remove(clock_waiter_t *waiter) {
+  clock_waiter_t **link;
+  int i = waiter->heap_index;
+
+  if (i >= 0) {
+    clock_deadline_count--;
+    if (i != clock_deadline_count) {
+      clock_deadlines[i] = clock_deadlines[clock_deadline_count];
+      clock_deadlines[i]->heap_index = i;
+      clock_deadline_sift(i);
+    }
+  }
+  if (waiter->sem != NULL || waiter->word != NULL) {
+    link = clock_wakeup_bucket(waiter->sem != NULL ? (void *)waiter->sem
+                                                   : (void *)waiter->word);
+  } else if (waiter->deadline == CLOCK_NEVER) {
+    link = &clock_idle_waiters;
+  } else {
+    return;
+  }
+  while (*link != waiter) {
+    link = &(*link)->next;
+  }
+  *link = waiter->next;
+}
+
+/*
+ * Mark the first waiter on a semaphore or wakeup word runnable. Called with
+ * clock_mutex held.
+ */
+static void clock_wake_one(const void *object) {
+  clock_waiter_t *waiter;
+
+  for (waiter = *clock_wakeup_bucket(object); waiter != NULL;
+       waiter = waiter->next) {
+    if ((waiter->sem == object || waiter->word == object) && !waiter->woken) {
+      waiter->woken = 1;
+      clock_waiting--;
+      clock_idle = 0;
+      pthread_cond_signal(&waiter->cond);
+      return;
+    }
+  }
+}
+
+/* Signal the waiters in the heap below i whose deadline has come */
+static void clock_signal_due(int i) {
+  if (i >= clock_deadline_count || clock_deadlines[i]->deadline > virtual_now) {
+    return;
+  }
+  pthread_cond_signal(&clock_deadlines[i]->cond);
+  clock_signal_due(2 * i + 1);
+  clock_signal_due(2 * i + 2);
+}
+
+/*
+ * Advance the simulated clock if every participant is blocked. Called with
+ * clock_mutex held. The clock jumps straight to the earliest deadline any
+ * waiter has, so idle stretches take no wall time at all.
+ */
+static void clock_advance_locked() {
+  clock_waiter_t *waiter;
+
+  if (clock_waiting < clock_participants) {
+    return;
+  }
+  if (clock_deadline_count == 0) {
+    // Nobody has anything scheduled, let clock_wait_idle return
+    if (!clock_idle) {
+      clock_idle = 1;
+      for (waiter = clock_idle_waiters; waiter != NULL; waiter = waiter->next) {
+        pthread_cond_signal(&waiter->cond);
+      }
+    }
+  } else if (clock_deadlines[0]->deadline > virtual_now) {
+    virtual_now = clock_deadlines[0]->deadline;
+    // Wake only the waiters whose deadline has come, the others would go
+    // straight back to sleep
+    clock_signal_due(0);
+  }
+}
+
+static int clock_wait_simulated(sem_t *sem, atomic_int *word,
+                                time_t deadline) {
+  clock_waiter_t self;
+  int result;
+
+  pthread_cond_init(&self.cond, NULL);
+  pthread_mutex_lock(&clock_mutex);
+  self.deadline = deadline;
+  self.sem = sem;
+  self.word = word;
+  self.woken = 0;
+  clock_waiter_add(&self);
+  clock_waiting++;
+
+  while (1) {
+    if ((sem != NULL && sem_trywait(sem) == 0) ||
+        (word != NULL && atomic_exchange(word, 0) != 0)) {
+      result = 0;
+      break;
+    }
+    if (self.woken) {
+      // Someone else consumed the post, go back to waiting
+      self.woken = 0;
+      clock_waiting++;
+    }
+    if (virtual_now >= deadline) {
+      result = ETIMEDOUT;
+      break;
+    }
+    clock_advance_locked();
+    if (sem == NULL && word == NULL && deadline == CLOCK_NEVER && clock_idle) {
+      result = ETIMEDOUT;
+      break;
+    }
+    if (virtual_now >= deadline) {
+      continue;
+    }
+    pthread_cond_wait(&self.cond, &clock_mutex);
+  }
+
+  // Remove this waiter from the heap and its bucket
+  clock_waiter_remove(&self);
+  if (!self.woken) {
+    clock_waiting--;
+  }
+  clock_idle = 0;
+  pthread_mutex_unlock(&clock_mutex);
+  pthread_cond_destroy(&self.cond);
+  return result;
+}
+
+void clock_sleep(int seconds) {
+  if (clock_source == CLOCK_SOURCE_REAL) {
+    sleep(seconds);
+    return;
+  }
+  clock_wait_simulated(NULL, NULL, clock_now() + seconds);
+}
+
+int clock_timedwait(sem_t *sem, time_t deadline) {
+  struct timespec wait_until;
+
+  if (clock_source == CLOCK_SOURCE_SIMULATED) {
+    return clock_wait_simulated(sem, NULL, deadline);
+  }
+  if (deadline == CLOCK_NEVER) {
+    while (sem_wait(sem) == -1) {
+      if (errno != EINTR) {
+        errno_abort("Semaphore wait");
+      }
+    }
+    return 0;
+  }
+  // sem_timedwait takes an absolute CLOCK_REALTIME time, not a duration
+  wait_until.tv_sec = deadline;
+  wait_until.tv_nsec = 0;
+  while (sem_timedwait(sem, &wait_until) == -1) {
+    if (errno == ETIMEDOUT) {
+      return ETIMEDOUT;
+    }
+    if (errno != EINTR) {
+      errno_abort("Semaphore timed wait");
+    }
+  }
+  return 0;
+}
+
+int clock_futex_wait(atomic_int *word, time_t deadline) {
+  struct timespec wait_until;
+
+  if (clock_source == CLOCK_SOURCE_SIMULATED) {
+    return clock_wait_simulated(NULL, word, deadline);
+  }
+  wait_until.tv_sec = deadline;
+  wait_until.tv_nsec = 0;
+  while (atomic_exchange(word, 0) == 0) {
+    if (deadline != CLOCK_NEVER && time(NULL) >= deadline) {
+      return ETIMEDOUT;
+    }
+    // Sleep only while the word is still 0, with an absolute realtime
+    // deadline like sem_timedwait
+    if (syscall(SYS_futex, word, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+                0, deadline == CLOCK_NEVER ? NULL : &wait_until, NULL,
+                FUTEX_BITSET_MATCH_ANY) == -1 &&
+        errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+      errno_abort("Futex wait");
+    }
+  }
+  return 0;
+}
+
+void clock_futex_wake(atomic_int *word) {
+  if (atomic_exchange(word, 1) != 0) {
+    // Already set, the waiter has not consumed the last wakeup yet
+    return;
+  }
+  if (clock_source == CLOCK_SOURCE_REAL) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    return;
+  }
+  pthread_mutex_lock(&clock_mutex);
+  // Mark the waiter runnable so time does not move past it
+  clock_wake_one(word);
+  pthread_mutex_unlock(&clock_mutex);
+}
+
+void notify_monitor(time_t expiration) {
+  if (expiration != 0 && expiration >= atomic_load(&monitor_deadline)) {
+    // The monitor wakes up before this alarm expires anyway
+    return;
+  }
+  atomic_fetch_add(&monitor_notifications, 1);
+  clock_futex_wake(&monitor_wakeup);
+}
+
+void clock_post(sem_t *sem) {
+  if (clock_source == CLOCK_SOURCE_REAL) {
+    sem_post(sem);
+    return;
+  }
+  pthread_mutex_lock(&clock_mutex);
+  sem_post(sem);
+  // Mark a waiter on this semaphore runnable so time does not move past it
+  clock_wake_one(sem);
+  pthread_mutex_unlock(&clock_mutex);
+}
+
+void clock_join() {
+  if (clock_source == CLOCK_SOURCE_REAL) {
+    return;
+  }
+  pthread_mutex_lock(&clock_mutex);
+  clock_participants++;
+  clock_idle = 0;
+  pthread_mutex_unlock(&clock_mutex);
+}
+
+void clock_leave() {
+  if (clock_source == CLOCK_SOURCE_REAL) {
+    return;
+  }
+  pthread_mutex_lock(&clock_mutex);
+  clock_participants--;
+  // The remaining threads may all be waiting now, advance for them
+  clock_advance_locked();
+  pthread_mutex_unlock(&clock_mutex);
+}
+
+void clock_wait_idle() {
+  if (clock_source == CLOCK_SOURCE_SIMULATED) {
+    clock_wait_simulated(NULL, NULL, CLOCK_NEVER);
+  }
+}
+
+/*
+ * Parse a CPU list such as "0-3,8" into a CPU set. Only CPUs this process is
+ * allowed to run on are accepted.
+ */
+static int parse_cpu_list(const char *text, cpu_set_t *cpus,
+                          cpu_set_t *unavailable) {
+  cpu_set_t allowed;
+  const char *cursor = text;
+  int first, last, consumed;
+
+  CPU_ZERO(cpus);
+  while (*cursor != '\0') {
+    if (sscanf(cursor, "%d%n", &first, &consumed) != 1 || first < 0) {
+      return -1;
+    }
+    cursor += consumed;
+    last = first;
+    if (*cursor == '-') {
+      if (sscanf(cursor + 1, "%d%n", &last, &consumed) != 1 || last < first) {
+        return -1;
+      }
+      cursor += consumed + 1;
+    }
+    if (last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (; first <= last; first++) {
+      CPU_SET(first, cpus);
+    }
+    if (*cursor == ',' || *cursor == '\n') {
+      cursor++;
+    } else if (*cursor != '\0') {
+      return -1;
+    }
+  }
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  // Report the CPUs asked for that this process may not run on
+  CPU_XOR(unavailable, cpus, &allowed);
+  CPU_AND(unavailable, unavailable, cpus);
+  CPU_AND(cpus, cpus, &allowed);
+  return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+/* Format a CPU set back into the compact "0-3,8" form */
+static void format_cpu_list(cpu_set_t *cpus, char *text, size_t size) {
+  int cpu, last;
+  size_t used = 0;
+
+  text[0] = '\0';
+  for (cpu = 0; cpu < CPU_SETSIZE && used < size; cpu++) {
+    if (!CPU_ISSET(cpu, cpus)) {
+      continue;
+    }
+    for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus);
+         last++)
+      ;
+    if (last == cpu) {
+      used += snprintf(text + used, size - used, "%s%d", used ? "," : "", cpu);
+    } else {
+      used += snprintf(text + used, size - used, "%s%d-%d", used ? "," : "",
+                       cpu, last);
+    }
+    cpu = last;
+  }
+}
+
+int parse_thread_placement(const char *spec) {
+  char buffer[256], cpus_text[64] = "", path[64], node_cpus[256];
+  char *options, *option, *save;
+  thread_placement_t *placement = NULL;
+  int role, in_cpus = 0, node;
+  long value;
+  FILE *file;
+  cpu_set_t unavailable;
+
+  strncpy(buffer, spec, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = '\0';
+  options = strchr(buffer, ':');
+  if (options == NULL) {
+    return -1;
+  }
+  *options++ = '\0';
+  for (role = 0; role < THREAD_ROLE_COUNT; role++) {
+    if (strcmp(buffer, thread_placements[role].name) == 0) {
+      placement = &thread_placements[role];
+    }
+  }
+  if (placement == NULL) {
+    return -1;
+  }
+
+  for (option = strtok_r(options, ",", &save); option != NULL;
+       option = strtok_r(NULL, ",", &save)) {
+    if (strncmp(option, "cpus=", 5) == 0) {
+      snprintf(cpus_text, sizeof(cpus_text), "%s", option + 5);
+      in_cpus = 1;
+      continue;
+    }
+    if (strchr(option, '=') == NULL && in_cpus) {
+      // More entries of a comma separated CPU list
+      strncat(cpus_text, ",", sizeof(cpus_text) - strlen(cpus_text) - 1);
+      strncat(cpus_text, option, sizeof(cpus_text) - strlen(cpus_text) - 1);
+      continue;
+    }
+    in_cpus = 0;
+    if (sscanf(option, "node=%d", &node) == 1 && node >= 0) {
+      // Pin to the CPUs of a NUMA node, as listed by the kernel
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+               node);
+      file = fopen(path, "r");
+      if (file == NULL || fgets(node_cpus, sizeof(node_cpus), file) == NULL ||
+          parse_cpu_list(node_cpus, &placement->cpus, &unavailable) != 0) {
+        fprintf(stderr, "No usable CPUs on NUMA node %d\n", node);
+        if (file != NULL) {
+          fclose(file);
+        }
+        return -1;
+      }
+      fclose(file);
+      if (CPU_COUNT(&unavailable) > 0) {
+        // The node is still usable, only part of it is off limits
+        format_cpu_list(&unavailable, node_cpus, sizeof(node_cpus));
+        fprintf(stderr, "CPUs %s of NUMA node %d are not available, using the "
+                "rest\n", node_cpus, node);
+      }
+      placement->cpus_set = 1;
+      snprintf(placement->cpus_text, sizeof(placement->cpus_text), "node%d",
+               node);
+    } else if (sscanf(option, "stack=%ld", &value) == 1 &&
+               value >= PTHREAD_STACK_MIN &&
+               placement != &thread_placements[THREAD_ROLE_INPUT]) {
+      // The main thread's stack is set up before main runs
+      placement->stack_size = value;
+    } else if (sscanf(option, "priority=%ld", &value) == 1 &&
+               value >= sched_get_priority_min(SCHED_FIFO) &&
+               value <= sched_get_priority_max(SCHED_FIFO)) {
+      placement->priority = value;
+    } else {
+      return -1;
+    }
+  }
+
+  if (cpus_text[0] != '\0') {
+    if (parse_cpu_list(cpus_text, &placement->cpus, &unavailable) != 0) {
+      fprintf(stderr, "No usable CPUs in %s\n", cpus_text);
+      return -1;
+    }
+    if (CPU_COUNT(&unavailable) > 0) {
+      // Pin exactly where asked or not at all
+      format_cpu_list(&unavailable, node_cpus, sizeof(node_cpus));
+      fprintf(stderr, "CPUs %s in %s are not available\n", node_cpus,
+              cpus_text);
+      return -1;
+    }
+    placement->cpus_set = 1;
+    snprintf(placement->cpus_text, sizeof(placement->cpus_text), "%s",
+             cpus_text);
+  }
+  return 0;
+}
+
+int create_placed_thread(pthread_t *thread, thread_role_t role,
+                         void *(*start)(void *), void *arg) {
+  thread_placement_t *placement = &thread_placements[role];
+  pthread_attr_t attr;
+  struct sched_param param;
+  int status;
+
+  pthread_attr_init(&attr);
+  if (placement->stack_size != 0) {
+    pthread_attr_setstacksize(&attr, placement->stack_size);
+  }
+  // Place every thread explicitly, otherwise a role without a placement of
+  // its own would take the CPUs and policy of the thread creating it
+  pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+                              placement->cpus_set ? &placement->cpus
+                                                  : &process_cpus);
+  if (role == THREAD_ROLE_DISPLAY) {
+    // Display threads exit on their own and are never joined
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  }
+  param.sched_priority = placement->priority;
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr,
+                              placement->priority != 0 ? SCHED_FIFO
+                                                       : SCHED_OTHER);
+  pthread_attr_setschedparam(&attr, &param);
+
+  status = pthread_create(thread, &attr, start, arg);
+  if (status == EPERM && placement->priority != 0) {
+    // Real-time priorities need privileges, fall back to the default policy
+    fprintf(stderr, "No permission to run %s threads at priority %d, using "
+                    "the default policy\n",
+            placement->name, placement->priority);
+    placement->priority = 0;
+    param.sched_priority = 0;
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    status = pthread_create(thread, &attr, start, arg);
+  }
+  pthread_attr_destroy(&attr);
+  return status;
+}
+
+void place_input_thread() {
+  thread_placement_t *placement = &thread_placements[THREAD_ROLE_INPUT];
+  struct sched_param param;
+
+  // Threads of other roles run where the process ran before being placed
+  sched_getaffinity(0, sizeof(process_cpus), &process_cpus);
+  if (placement->cpus_set) {
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                           &placement->cpus);
+  }
+  if (placement->priority != 0) {
+    param.sched_priority = placement->priority;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+      fprintf(stderr, "No permission to run input threads at priority %d, "
+                      "using the default policy\n",
+              placement->priority);
+      placement->priority = 0;
+    }
+  }
+}
+
+/* Print where a thread actually runs, as reported by the system */
+static void print_thread_placement(const char *role, pthread_t thread) {
+  cpu_set_t cpus;
+  pthread_attr_t attr;
+  struct sched_param param;
+  size_t stack_size = 0;
+  int policy = SCHED_OTHER;
+  char cpus_text[256] = "?";
+
+  if (pthread_getaffinity_np(thread, sizeof(cpus), &cpus) == 0) {
+    format_cpu_list(&cpus, cpus_text, sizeof(cpus_text));
+  }
+  if (pthread_getattr_np(thread, &attr) == 0) {
+    pthread_attr_getstacksize(&attr, &stack_size);
+    pthread_attr_destroy(&attr);
+  }
+  param.sched_priority = 0;
+  pthread_getschedparam(thread, &policy, &param);
+  printf("Placement of %s Thread %lu at %ld: CPUs(%s) Stack(%zu) "
+         "Policy(%s) Priority(%d)\n",
+         role, thread, clock_now(), cpus_text, stack_size,
+         policy == SCHED_FIFO ? "FIFO" : "OTHER", param.sched_priority);
+}
+
+void print_stats() {
+  display_alarm_info_t *current;
+  int role, alarms, pending_changes, display_threads;
+
+  // Configured placement of each role
+  for (role = 0; role < THREAD_ROLE_COUNT; role++) {
+    thread_placement_t *placement = &thread_placements[role];
+    printf("Placement Policy for %s Threads: CPUs(%s) Stack(%zu) "
+           "Priority(%d)\n",
+           placement->name,
+           placement->cpus_set ? placement->cpus_text : "any",
+           placement->stack_size, placement->priority);
+  }
+
+  // Admission limits and how often they were hit, each count read under the
+  // lock that protects it
+  start_reading();
+  alarms = deadline_heap_size;
+  stop_reading();
+  sem_wait(&changed_alarm_semaphore);
+  pending_changes = admission.pending_changes;
+  sem_post(&changed_alarm_semaphore);
+  sem_wait(&display_list_semaphore);
+  display_threads = admission.display_threads;
+  sem_post(&display_list_semaphore);
+  printf("Admission at %ld: Alarms(%d of %d) Pending Changes(%d of %d) "
+         "Display Threads(%d of %d)\n",
+         clock_now(), alarms, admission.max_alarms, pending_changes,
+         admission.max_pending_changes, display_threads,
+         admission.max_display_threads);
+  printf("Rejected at %ld: Alarms(%ld) Changes(%ld) No Display(%ld)\n",
+         clock_now(), atomic_load(&admission.rejected_alarms),
+         atomic_load(&admission.rejected_changes),
+         atomic_load(&admission.rejected_displays));
+
+  printf("Alarms at %ld: Inserted(%ld) Removed(%ld)\n", clock_now(),
+         atomic_load(&alarms_inserted), atomic_load(&alarms_removed));
+  printf("Monitor at %ld: Notifications(%ld) Wakeups(%ld)\n", clock_now(),
+         atomic_load(&monitor_notifications), atomic_load(&monitor_wakeups));
+
+  // Actual placement of each running thread
+  print_thread_placement("Input", input_thread);
+  print_thread_placement("Monitor", monitor_thread);
+  sem_wait(&display_list_semaphore);
+  for (current = display_alarm_threads; current != NULL;
+       current = current->next) {
+    print_thread_placement("Display", current->thread);
+  }
+  sem_post(&display_list_semaphore);
+}
+
 void *display_alarm(void *args) {
+  display_alarm_info_t *context = args;
   // Extract the thread ID and alarm group for this display thread
   pthread_t self_id = pthread_self();
 
-  // Local variables to store information
-  int local_alarm1 = -1, local_alarm2 = -1;
-
-  int local_alarm_group = -1;
-  int local_alarm1_taken_over = 0, local_alarm2_taken_over = 0;
-  char local_alarm1_message[128];
-  char local_alarm2_message[128];
+  // Local copies of the slots and of the alarms they own
+  display_slot_t local_slot[DISPLAY_SLOTS];
+  int owned[DISPLAY_SLOTS], found[DISPLAY_SLOTS], seconds[DISPLAY_SLOTS];
+  char message[DISPLAY_SLOTS][128];
+  time_t next_print = clock_now() + 5;
+  display_alarm_info_t **prev_thread;
+  display_slot_t *slot;
+  alarm_t *alarm;
+  int i, due;
 
   while (1) {
-    // Sleep for 5 seconds first
-    sleep(5);
-
-    // Lock the display list semaphore to access the display alarm list
-    sem_wait(&display_list_semaphore);
-
-    // Search for this thread's entry in the display alarm list
-    display_alarm_info_t *current_thread = display_alarm_threads;
-    display_alarm_info_t *prev_thread = NULL;
-
-    while (current_thread != NULL) {
-      if (pthread_equal(current_thread->thread, self_id)) {
-        // Found the current thread's entry in the list, update local variables
-        local_alarm_group = current_thread->alarm_group;
-        local_alarm1 = current_thread->alarm1;
-        local_alarm2 = current_thread->alarm2;
-        local_alarm1_taken_over = current_thread->alarm1_taken_over;
-        local_alarm2_taken_over = current_thread->alarm2_taken_over;
-        strcpy(local_alarm1_message, current_thread->alarm1_message);
-        strcpy(local_alarm2_message, current_thread->alarm2_message);
-        break;
-      }
-      prev_thread = current_thread;
-      current_thread = current_thread->next;
+    // Sleep until the next print 5 seconds on, or until an alarm is handed
+    // to or taken from this thread
+    clock_futex_wait(&context->wakeup, next_print);
+    due = clock_now() >= next_print;
+    if (due) {
+      next_print = clock_now() + 5;
     }
 
-    int old_local_alarm1 = local_alarm1;
-    int old_local_alarm2 = local_alarm2;
+    // Copy the slots, the main and monitor threads reserve the empty ones
+    sem_wait(&display_list_semaphore);
+    memcpy(local_slot, context->slot, sizeof(local_slot));
+    sem_post(&display_list_semaphore);
 
-    // Lock the semaphore to access the alarm list
+    // Check which alarms this thread still owns. An alarm that changed group
+    // or was removed and inserted again has a different owner by now.
     start_reading();
-
-    // Check if local_alarm1 is not -1
-    if (local_alarm1 != -1) {
-      alarm_t *current_alarm = alarm_list;
-      int alarm1_found = 0;
-      while (current_alarm != NULL) {
-        if (current_alarm->alarm_id == local_alarm1) {
-          if (current_alarm->group == local_alarm_group) {
-            if (local_alarm1_taken_over) {
-              // Taken over alarm
-              // Print the alarm message when taken oven
-              printf("Display Thread %lu Has Taken Over Printing Message of "
-                     "Alarm(%d) at %ld: Changed Group(%d) %d %s\n",
-                     self_id, current_alarm->alarm_id, time(NULL),
-                     local_alarm_group, current_alarm->seconds,
-                     current_alarm->message);
-              alarm1_found = 1;
-            } else {
-              if (strcmp(local_alarm1_message, current_alarm->message) != 0) {
-                // Message changed
-                printf("Display Thread %lu Starts to Print Changed Message of "
-                       "Alarm(%d) at %ld: Group(%d) %d %s\n",
-                       self_id, current_alarm->alarm_id, time(NULL),
-                       local_alarm_group, current_alarm->seconds,
-                       current_alarm->message);
-                alarm1_found = 1;
-                // Copy current_alarm->message to local_alarm1_message
-                strcpy(local_alarm1_message, current_alarm->message);
-
-              } else {
-                // Print the alarm message not taken oven, same message
-                printf("Alarm (%d) Printed by Alarm Display Thread %lu at %ld: "
-                       "Group(%d) %d %s\n",
-                       local_alarm1, self_id, time(NULL), local_alarm_group,
-                       current_alarm->seconds, current_alarm->message);
-              }
-            }
-            alarm1_found = 1;
-            break;
-          } else {
-            // Alarm found but group has changed,
-            printf("Display Thread %lu Has Stopped Printing Message of "
-                   "Alarm(%d) at %ld: Changed Group(%d) %s\n",
-                   self_id, local_alarm1, time(NULL), local_alarm_group,
-                   local_alarm1_message);
-            // Update local variables and thread information
-            current_thread->alarms_in_group--;
-            alarm1_found = 1;
-            local_alarm1 = -1;
-            local_alarm1_taken_over = 0;
-            break;
-          }
-        }
-        current_alarm = current_alarm->link;
+    for (i = 0; i < DISPLAY_SLOTS; i++) {
+      owned[i] = found[i] = 0;
+      if (local_slot[i].alarm_id == -1 || local_slot[i].pending) {
+        continue;
       }
-      // Alarm removed from list
-      if (!alarm1_found) {
-        // alarm1 is no longer in the alarm
-        printf("Display Thread %lu Has Stopped Printing Message of Alarm(%d) "
-               "at %ld: Group(%d) %s\n",
-               self_id, local_alarm1, time(NULL), local_alarm_group,
-               local_alarm1_message);
-        // Update local variables and thread information
-        current_thread->alarms_in_group--;
-        local_alarm1 = -1;
-        local_alarm1_taken_over = -1;
+      alarm = alarm_index_find(local_slot[i].alarm_id);
+      found[i] = alarm != NULL;
+      if (alarm != NULL && atomic_load(&alarm->owner) == &context->slot[i]) {
+        owned[i] = 1;
+        seconds[i] = alarm->seconds;
+        strcpy(message[i], alarm->message);
       }
     }
+    stop_reading();
 
-    // Similarly, perform the same steps for local_alarm2
-    // Check if local_alarm2 is not -1
-    if (local_alarm2 != -1) {
-      alarm_t *current_alarm = alarm_list;
-      int alarm2_found = 0;
-      while (current_alarm != NULL) {
-        if (current_alarm->alarm_id == local_alarm2) {
-          if (current_alarm->group == local_alarm_group) {
-            if (local_alarm2_taken_over) {
-              // Taken over alarm
-              // Print the alarm message when taken over
-              printf("Display Thread %lu Has Taken Over Printing Message of "
-                     "Alarm(%d) at %ld: Changed Group(%d) %d %s\n",
-                     self_id, current_alarm->alarm_id, time(NULL),
-                     local_alarm_group, current_alarm->seconds,
-                     current_alarm->message);
-              alarm2_found = 1;
-            } else {
-              if (strcmp(local_alarm2_message, current_alarm->message) != 0) {
-                // Message changed
-                printf("Display Thread %lu Starts to Print Changed Message of "
-                       "Alarm(%d) at %ld: Group(%d) %d %s\n",
-                       self_id, current_alarm->alarm_id, time(NULL),
-                       local_alarm_group, current_alarm->seconds,
-                       current_alarm->message);
-                alarm2_found = 1;
-                // Copy current_alarm->message to local_alarm2_message
-                strcpy(local_alarm2_message, current_alarm->message);
-              } else {
-                // Print the alarm message not taken over, same message
-                printf("Alarm (%d) Printed by Alarm Display Thread %lu at %ld: "
-                       "Group(%d) %d %s\n",
-                       local_alarm2, self_id, time(NULL), local_alarm_group,
-                       current_alarm->seconds, current_alarm->message);
-              }
-            }
-            alarm2_found = 1;
-            break;
-          } else {
-            // Alarm found but group has changed,
-            printf("Display Thread %lu Has Stopped Printing Message of "
-                   "Alarm(%d) at %ld: Changed Group(%d) %s\n",
-                   self_id, local_alarm2, time(NULL), local_alarm_group,
-                   local_alarm2_message);
-            // Update local variables and thread information
-            current_thread->alarms_in_group--;
-            alarm2_found = 1;
-            local_alarm2 = -1;
-            local_alarm2_taken_over = 0;
-            break;
-          }
-        }
-        current_alarm = current_alarm->link;
+    // Lock the display list semaphore to update the slots
+    sem_wait(&display_list_semaphore);
+    for (i = 0; i < DISPLAY_SLOTS; i++) {
+      slot = &context->slot[i];
+      if (local_slot[i].alarm_id == -1 || local_slot[i].pending) {
+        // Empty, or reserved since and not handed over yet
+        continue;
       }
-      // Alarm removed from list
-      if (!alarm2_found) {
-        // alarm2 is no longer in the alarm
-        printf("Display Thread %lu Has Stopped Printing Message of Alarm(%d) "
-               "at %ld: Group(%d) %s\n",
-               self_id, local_alarm2, time(NULL), local_alarm_group,
-               local_alarm2_message);
-        // Update local variables and thread information
-        current_thread->alarms_in_group--;
-        local_alarm2 = -1;
-        local_alarm2_taken_over = -1;
+      if (!owned[i]) {
+        if (found[i]) {
+          // Alarm found but group has changed,
+          printf("Display Thread %lu Has Stopped Printing Message of "
+                 "Alarm(%d) at %ld: Changed Group(%d) %s\n",
+                 self_id, slot->alarm_id, clock_now(), context->alarm_group,
+                 slot->message);
+        } else {
+          // Alarm removed from list
+          printf("Display Thread %lu Has Stopped Printing Message of "
+                 "Alarm(%d) at %ld: Group(%d) %s\n",
+                 self_id, slot->alarm_id, clock_now(), context->alarm_group,
+                 slot->message);
+        }
+        // Empty the slot so it can be reserved again
+        slot->alarm_id = -1;
+        slot->taken_over = 0;
+        context->alarms_in_group--;
+      } else if (slot->taken_over) {
+        // Print the alarm message once when taken over
+        printf("Display Thread %lu Has Taken Over Printing Message of "
+               "Alarm(%d) at %ld: Changed Group(%d) %d %s\n",
+               self_id, slot->alarm_id, clock_now(), context->alarm_group,
+               seconds[i], message[i]);
+        slot->taken_over = 0;
+        strcpy(slot->message, message[i]);
+      } else if (strcmp(slot->message, message[i]) != 0) {
+        // Message changed
+        printf("Display Thread %lu Starts to Print Changed Message of "
+               "Alarm(%d) at %ld: Group(%d) %d %s\n",
+               self_id, slot->alarm_id, clock_now(), context->alarm_group,
+               seconds[i], message[i]);
+        strcpy(slot->message, message[i]);
+      } else if (due) {
+        // Print the alarm message not taken over, same message
+        printf("Alarm (%d) Printed by Alarm Display Thread %lu at %ld: "
+               "Group(%d) %d %s\n",
+               slot->alarm_id, self_id, clock_now(), context->alarm_group,
+               seconds[i], message[i]);
       }
     }
-    // Unlock the semaphore to release the alarm list
-    stop_reading();
 
     // Check if both alarms were reassigned
-    if (local_alarm1 == -1 && local_alarm2 == -1) {
+    if (context->alarms_in_group == 0) {
       printf(
           "No More Alarms in Group(%d): Display Thread %ld exiting at %lu.\n",
-          local_alarm_group, self_id, time(NULL));
+          context->alarm_group, self_id, clock_now());
       // Update pointers to remove the node
-      if (prev_thread != NULL) {
-        prev_thread->next = current_thread->next;
-      } else {
-        // If the current thread is the head of the list
-        display_alarm_threads = current_thread->next;
+      prev_thread = &display_alarm_threads;
+      while (*prev_thread != context) {
+        prev_thread = &(*prev_thread)->next;
       }
-      // Free memory from the current thread
-      free(current_thread);
+      *prev_thread = context->next;
+      // Free memory from the current thread, nobody holds an owner pointing
+      // into it once its slots are empty
+      free(context);
+      admission.display_threads--;
       // Release the display list semaphore after accessing the list
       sem_post(&display_list_semaphore);
+      clock_leave();
       pthread_exit(NULL); // Terminate the thread
     }
-
-    // Update the content of the thread
-    current_thread->alarm1 = local_alarm1;
-    current_thread->alarm2 = local_alarm2;
-    current_thread->alarm1_taken_over = local_alarm1_taken_over;
-    current_thread->alarm2_taken_over = local_alarm2_taken_over;
-    strcpy(current_thread->alarm1_message, local_alarm1_message);
-    strcpy(current_thread->alarm2_message, local_alarm2_message);
     // Release the display list semaphore after accessing the list
     sem_post(&display_list_semaphore);
   }
@@ -254,345 +1198,1350 @@ void *display_alarm(void *args) {
 }
 
 void *monitor_alarms(void *args) {
-  // Wait for a new alarm insertion in the alarm list of changed alarm list
-  sem_wait(&monitor_semaphore);
+  alarm_t *changes;
 
   while (1) {
-    // Check for changed alarm requests and process them if any
+    // Take the pending change requests, the main thread can queue new ones
+    // while these are applied
     sem_wait(&changed_alarm_semaphore);
+    changes = changed_alarm_list;
+    changed_alarm_list = NULL;
+    sem_post(&changed_alarm_semaphore);
 
-    while (changed_alarm_list != NULL) {
-      alarm_t *current = changed_alarm_list;
-      alarm_t *prev = NULL;
-      //Lock the semaphore to write to the alarm list
-      sem_wait(&alarm_write_semaphore);
-      
-      while (current != NULL) {
+    while (changes != NULL) {
+      alarm_t *current = changes;
+      display_slot_t *slot = NULL, *previous;
+      int claimed = 0;
+
+      while (1) {
         // Find the corresponding alarm in the alarm list
-        alarm_t *alarm_to_change = NULL;
-        alarm_t *alarm_iterator = alarm_list;
+        start_reading();
+        alarm_t *alarm_to_change = alarm_index_find(current->alarm_id);
+        int changes_group =
+            alarm_to_change != NULL && alarm_to_change->group != current->group;
+        stop_reading();
 
-        while (alarm_iterator != NULL) {
-          if (current->alarm_id == alarm_iterator->alarm_id) {
-            alarm_to_change = alarm_iterator;
+        if (alarm_to_change == NULL) {
+          // Print invalid change alarm message
+          printf("Invalid Change Alarm Request(%d) at %ld: Group(%d) %d %s\n",
+                 current->alarm_id, clock_now(), current->group,
+                 current->seconds, current->message);
+          trace_event(TRACE_CHANGE_REJECTED, current, 0);
+          break;
+        }
+        if (changes_group && slot == NULL) {
+          // Reserve a display slot in the new group before the alarm list is
+          // locked, so the two semaphores are never held together
+          slot = check_or_create_display_thread(current, 1);
+          if (slot == NULL) {
+            // The new group has no display thread for the alarm, keep it
+            printf("Change Alarm Request(%d) Rejected by Alarm Monitor Thread "
+                   "%lu at %ld: No Display Thread Available for Group(%d)\n",
+                   current->alarm_id, pthread_self(), clock_now(),
+                   current->group);
+            trace_event(TRACE_CHANGE_REJECTED, current, 0);
             break;
           }
-          alarm_iterator = alarm_iterator->link;
         }
 
-        if (alarm_to_change != NULL) {
-          // Replace values in the corresponding alarm with Change_Alarm request
-          // values
-          int old_group = alarm_to_change->group;
-          alarm_to_change->group = current->group;
-          alarm_to_change->seconds = current->seconds;
-          alarm_to_change->time = time(NULL);
-          strcpy(alarm_to_change->message, current->message);
-
-          // Print change message
-          printf("Alarm Monitor Thread %ld Has Changed Alarm(%d) at %ld: "
-                 "Group(%d) "
-                 "%d %s\n",
-                 pthread_self(), alarm_to_change->alarm_id, time(NULL),
-                 alarm_to_change->group, alarm_to_change->seconds,
-                 alarm_to_change->message);
-          if(old_group != alarm_to_change->group){
-            check_or_create_display_thread(alarm_to_change, 1);
+        //Lock the semaphore to write to the alarm list
+        sem_wait(&alarm_write_semaphore);
+        alarm_to_change = alarm_index_find(current->alarm_id);
+        if (alarm_to_change == NULL ||
+            (alarm_to_change->group != current->group && slot == NULL)) {
+          // The alarm was taken out or put back in since it was looked up,
+          // look again
+          sem_post(&alarm_write_semaphore);
+          continue;
+        }
+        if (alarm_to_change->group != current->group) {
+          // Hand the alarm to the reserved slot and tell the owner it had to
+          // stop printing it. Owners are only written with the alarm list
+          // locked for writing, so nothing else can switch it meanwhile.
+          previous = atomic_exchange(&alarm_to_change->owner, slot);
+          claimed = 1;
+          if (previous != NULL) {
+            notify_display_thread(previous->context);
           }
-        } else {
-          // Print invalid change alarm message
-          printf("Invalid Change Alarm Request(%d) at %ld: Group(%d) %d %s\n",
-                 current->alarm_id, time(NULL), current->group,
-                 current->seconds, current->message);
+        } else if ((previous = atomic_load(&alarm_to_change->owner)) != NULL) {
+          // Same group, let the owner print the new message at once
+          notify_display_thread(previous->context);
         }
 
-        // Remove the Change_Alarm request from the list
-        if (prev == NULL) {
-          changed_alarm_list = current->link;
-          free(current);
-          current = changed_alarm_list;
-        } else {
-          prev->link = current->link;
-          free(current);
-          current = prev->link;
+        // Replace values in the corresponding alarm with Change_Alarm request
+        // values
+        group_index_remove(alarm_to_change);
+        alarm_to_change->group = current->group;
+        group_index_insert(alarm_to_change);
+        alarm_to_change->seconds = current->seconds;
+        alarm_to_change->time = clock_now();
+        strcpy(alarm_to_change->message, current->message);
+        // Restart the alarm (and its periods) from now, in place
+        alarm_to_change->periods = 0;
+        alarm_to_change->expiration =
+            alarm_to_change->time + alarm_to_change->seconds;
+        deadline_heap_update(alarm_to_change);
+
+        // Print change message
+        printf("Alarm Monitor Thread %ld Has Changed Alarm(%d) at %ld: "
+               "Group(%d) "
+               "%d %s\n",
+               pthread_self(), alarm_to_change->alarm_id, clock_now(),
+               alarm_to_change->group, alarm_to_change->seconds,
+               alarm_to_change->message);
+        trace_event(TRACE_CHANGED, alarm_to_change,
+                    alarm_to_change->expiration);
+        //Unlock the semaphore to write to the alarm list
+        sem_post(&alarm_write_semaphore);
+        break;
+      }
+      if (slot != NULL) {
+        // Activate the new slot, or give it back if the change did not happen
+        publish_display_slot(slot, claimed);
+      }
+
+      // Remove the Change_Alarm request from the list
+      changes = current->link;
+      free(current);
+      // Give the change request slot back to the main thread
+      sem_wait(&changed_alarm_semaphore);
+      admission.pending_changes--;
+      sem_post(&changed_alarm_semaphore);
+      if (admission.max_pending_changes > 0) {
+        clock_post(&changed_slots_semaphore);
+      }
+    }
+
+    // Variables to find the closest alarm for display
+    alarm_t *closest_alarm = NULL;
+    time_t closest_expiration_time = 0;
+
+    // Lock the semaphore to prevent changes while checking for the nearest
+    // alarm
+    start_reading();
+    // The closest alarm is at the top of the deadline heap
+    if (deadline_heap_size > 0) {
+      closest_alarm = deadline_heap[0];
+      closest_expiration_time = closest_alarm->expiration;
+    } else {
+      // No alarms, sleep until an alarm or a change arrives
+      closest_expiration_time = CLOCK_NEVER;
+    }
+    // Publish the deadline while the list cannot change, an alarm inserted
+    // after this either is in the heap already or sees the new deadline
+    atomic_store(&monitor_deadline, closest_expiration_time);
+    // Release the semaphore after finding the nearest alarm
+    stop_reading();
+
+    if (closest_expiration_time > clock_now()) {
+      // Wait for either the nearest alarm or a signal indicating a change
+      if (clock_futex_wait(&monitor_wakeup, closest_expiration_time) == 0) {
+        atomic_fetch_add(&monitor_wakeups, 1);
+      }
+    }
+    //Check if there are alarms in the list that could have expired
+    if(closest_alarm != NULL){
+      process_expired_alarms();
+    }
+  }
+}
+
+void process_expired_alarms() {
+  time_t current_time = clock_now();
+  display_slot_t *owner;
+
+  // Lock the semaphore to access the alarm list
+  sem_wait(&alarm_write_semaphore);
+
+  while (deadline_heap_size > 0 &&
+         deadline_heap[0]->expiration <= current_time) {
+    alarm_t *current = deadline_heap[0];
+
+    if (current->periodic) {
+      // Count the periods that have elapsed since the last firing
+      int due = (current_time - current->expiration) / current->seconds + 1;
+      int fire, k;
+      if (current->repeat > 0 && due > current->repeat - current->periods) {
+        due = current->repeat - current->periods;
+      }
+      // Only fire for the latest periods after a stall, skip the rest
+      fire = due < max_catch_up ? due : max_catch_up;
+      if (due > fire) {
+        printf("Alarm Monitor Thread %ld Has Skipped %d Missed Periods of "
+               "Alarm(%d) at %ld: Group(%d) %d %s\n",
+               pthread_self(), due - fire, current->alarm_id, current_time,
+               current->group, current->seconds, current->message);
+      }
+      current->periods += due;
+      for (k = fire - 1; k >= 0; k--) {
+        printf("Alarm Monitor Thread %ld Has Fired Periodic Alarm(%d) Period "
+               "%d at %ld: Group(%d) %d %s\n",
+               pthread_self(), current->alarm_id, current->periods - k,
+               current_time, current->group, current->seconds,
+               current->message);
+        trace_event(TRACE_FIRED, current,
+                    current->time +
+                        (time_t)(current->periods - k) * current->seconds);
+      }
+      if (current->repeat == 0 || current->periods < current->repeat) {
+        // Re-arm in place, relative to the base time so it never drifts
+        current->expiration =
+            current->time + (time_t)(current->periods + 1) * current->seconds;
+        deadline_heap_update(current);
+        continue;
+      }
+    }
+
+    // Remove the expired alarm from the heap and the lists
+    atomic_fetch_add(&alarms_removed, 1);
+    deadline_heap_remove(current);
+    alarm_index_remove(current);
+    group_index_remove(current);
+
+    printf("Alarm Monitor Thread %ld Has Removed Alarm(%d) at %ld: "
+           "Group(%d) %d %s\n",
+           pthread_self(), current->alarm_id, current_time, current->group,
+           current->seconds, current->message);
+    trace_event(TRACE_REMOVED, current, current->expiration);
+    // Let the owner stop printing it now rather than at its next print
+    owner = atomic_load(&current->owner);
+    if (owner != NULL) {
+      notify_display_thread(owner->context);
+    }
+
+    free(current);
+  }
+
+  // Release the semaphore after processing expired alarms
+  sem_post(&alarm_write_semaphore);
+}
+
+void insert_alarm_changed(alarm_t *alarm) {
+  int status;
+  alarm_t **last, *next;
+
+  // Take a free change request slot, waiting a bounded time for the monitor
+  if (admission.max_pending_changes > 0 &&
+      clock_timedwait(&changed_slots_semaphore,
+                      clock_now() + admission.wait_seconds) != 0) {
+    atomic_fetch_add(&admission.rejected_changes, 1);
+    printf("Change Alarm Request(%d) Rejected by Main Thread %lu at %ld: "
+           "%d Changes Pending\n",
+           alarm->alarm_id, pthread_self(), clock_now(),
+           admission.max_pending_changes);
+    trace_event(TRACE_CHANGE_REJECTED, alarm, 0);
+    free(alarm);
+    return;
+  }
+
+  // Lock the changed alarms list mutex
+  status = sem_wait(&changed_alarm_semaphore);
+  if (status != 0) {
+    err_abort(status, "Lock mutex");
+  }
+
+  // Initialize pointers for traversal in the changed alarms list
+  last = &changed_alarm_list;
+  next = *last;
+
+  while (next != NULL) {
+    if (alarm->alarm_id < next->alarm_id) {
+      // Insert before next in the changed alarms list
+      alarm->link = next;
+      *last = alarm;
+      break;
+    } else {
+      // Move to the next item in the changed alarms list
+      last = &next->link;
+      next = *last;
+    }
+  }
+
+  // If we reach the end of the list, insert the alarm into changed alarms
+  if (next == NULL) {
+    *last = alarm;
+    alarm->link = NULL;
+  }
+  alarm->time = clock_now();
+  admission.pending_changes++;
+  printf("Change Alarm Request(%d) Inserted by Main Thread %ld into Alarm List "
+         "at %ld: Group(%d) %d %s\n",
+         alarm->alarm_id, pthread_self(), clock_now(), alarm->group,
+         alarm->seconds, alarm->message);
+
+  // Unlock the changed alarms list mutex
+  sem_post(&changed_alarm_semaphore);
+  notify_monitor(0);
+}
+
+display_slot_t *check_or_create_display_thread(alarm_t *alarm,
+                                               int taken_over) {
+  int status, i;
+  display_alarm_info_t *new_display_thread = NULL;
+  display_slot_t *slot;
+
+  sem_wait(&display_list_semaphore); // Lock to ensure thread safety
+
+  // Check if a display thread for the group already exists
+  display_alarm_info_t *current = display_alarm_threads;
+  while (current != NULL) {
+    if (current->alarm_group == alarm->group &&
+        current->alarms_in_group < DISPLAY_SLOTS) {
+      // Found a display thread assigned to the group with an empty slot
+      for (i = 0; current->slot[i].alarm_id != -1; i++)
+        ;
+      slot = &current->slot[i];
+      // Reserve the slot until the alarm's owner is set to it
+      slot->alarm_id = alarm->alarm_id;
+      slot->pending = 1;
+      slot->taken_over = taken_over;
+      strcpy(slot->message, alarm->message);
+      current->alarms_in_group++; // Increment the count of alarms in the group
+      // Print the creation message
+      printf("Main Thread %lu Assigned to Display Alarm Thread %lu at %ld: "
+             "Group(%d) %d %s\n",
+             pthread_self(), current->thread, clock_now(), alarm->group,
+             alarm->seconds, alarm->message);
+      sem_post(&display_list_semaphore);
+      return slot;
+    }
+    current = current->next; // Move to the next display thread
+  }
+
+  // No available display thread for the group and no room for a new one
+  if (admission.max_display_threads > 0 &&
+      admission.display_threads >= admission.max_display_threads) {
+    atomic_fetch_add(&admission.rejected_displays, 1);
+    sem_post(&display_list_semaphore);
+    return NULL;
+  }
+
+  // No available display thread for the group, create a new one
+  new_display_thread = malloc(sizeof(display_alarm_info_t));
+  if (new_display_thread == NULL) {
+    // Handle memory allocation failure
+    atomic_fetch_add(&admission.rejected_displays, 1);
+    sem_post(&display_list_semaphore); // Unlock before returning
+    return NULL;
+  }
+
+  // Initialize the new display thread
+  new_display_thread->alarm_group = alarm->group;
+  new_display_thread->alarms_in_group = 1;
+  atomic_init(&new_display_thread->wakeup, 0);
+  for (i = 0; i < DISPLAY_SLOTS; i++) {
+    new_display_thread->slot[i].context = new_display_thread;
+    new_display_thread->slot[i].alarm_id = -1; // -1 indicates an empty slot
+    new_display_thread->slot[i].pending = 0;
+    new_display_thread->slot[i].taken_over = 0;
+    new_display_thread->slot[i].message[0] = '\0';
+  }
+  slot = &new_display_thread->slot[0];
+  slot->alarm_id = alarm->alarm_id;
+  slot->pending = 1;
+  slot->taken_over = taken_over;
+  strcpy(slot->message, alarm->message);
+
+  // Add the new display thread at the beginning of the list
+  new_display_thread->next = display_alarm_threads;
+  display_alarm_threads = new_display_thread;
+
+  /* Create new thread */
+  clock_join();
+  status = create_placed_thread(&new_display_thread->thread,
+                                THREAD_ROLE_DISPLAY, display_alarm,
+                                new_display_thread);
+  if (status != 0) {
+    // Handle thread creation failure
+    clock_leave();
+    display_alarm_threads = new_display_thread->next;
+    free(new_display_thread);          // Free memory in case of failure
+    atomic_fetch_add(&admission.rejected_displays, 1);
+    sem_post(&display_list_semaphore); // Unlock before returning
+    return NULL;
+  }
+  admission.display_threads++;
+
+  // Print the creation message
+  printf("Main Thread Created New Display Alarm Thread %lu For Alarm(%d) at "
+         "%ld: Group(%d) %d %s\n",
+         new_display_thread->thread, alarm->alarm_id, clock_now(), alarm->group,
+         alarm->seconds, alarm->message);
+  sem_post(&display_list_semaphore); // Unlock before returning
+  return slot;
+}
+
+void publish_display_slot(display_slot_t *slot, int claimed) {
+  sem_wait(&display_list_semaphore);
+  if (!claimed) {
+    // The alarm went to another slot or away, empty the reservation
+    slot->alarm_id = -1;
+    slot->taken_over = 0;
+    slot->context->alarms_in_group--;
+  }
+  slot->pending = 0;
+  // Notify while the list is locked, the thread cannot exit before that
+  notify_display_thread(slot->context);
+  sem_post(&display_list_semaphore);
+}
+
+void notify_display_thread(display_alarm_info_t *context) {
+  clock_futex_wake(&context->wakeup);
+}
+
+/*
+ * Reject the alarm if the list is full or holds its id already. Called with
+ * the alarm list locked for reading or writing. The alarm is not freed.
+ */
+static int reject_alarm(alarm_t *alarm) {
+  if (admission.max_alarms > 0 && deadline_heap_size >= admission.max_alarms) {
+    atomic_fetch_add(&admission.rejected_alarms, 1);
+    printf("Alarm(%d) Rejected by Main Thread %lu at %ld: %d Alarms in Alarm "
+           "List\n",
+           alarm->alarm_id, pthread_self(), clock_now(), admission.max_alarms);
+    trace_event(TRACE_REJECTED, alarm, 0);
+    return 1;
+  }
+  if (alarm_index_find(alarm->alarm_id) != NULL) {
+    // An alarm with the same ID already exists, don't insert the new alarm
+    printf("An alarm with ID %d already exists.\n", alarm->alarm_id);
+    trace_event(TRACE_REJECTED, alarm, 0);
+    return 1;
+  }
+  return 0;
+}
+
+void insert_alarm(alarm_t *alarm) {
+  int status, rejected;
+  time_t expiration;
+  display_slot_t *slot;
+
+  // Turn the alarm away early if it cannot be inserted, before a display
+  // thread is set up for it
+  start_reading();
+  rejected = reject_alarm(alarm);
+  stop_reading();
+  if (rejected) {
+    free(alarm);
+    return;
+  }
+
+  // Reserve a display slot before the alarm is in the list, so an alarm in
+  // the list always has an owner and is never taken back out
+  slot = check_or_create_display_thread(alarm, 0);
+  if (slot == NULL) {
+    printf("Alarm(%d) Rejected by Main Thread %lu at %ld: No Display Thread "
+           "Available for Group(%d)\n",
+           alarm->alarm_id, pthread_self(), clock_now(), alarm->group);
+    trace_event(TRACE_REJECTED, alarm, 0);
+    free(alarm);
+    return;
+  }
+
+  // lock the alarm list mutex
+  status = sem_wait(&alarm_write_semaphore);
+  if (status != 0) {
+    err_abort(status, "Lock semap");
+  }
+
+  // Look again, another thread may have filled the list or used the id
+  if (reject_alarm(alarm)) {
+    sem_post(&alarm_write_semaphore);
+    publish_display_slot(slot, 0);
+    free(alarm);
+    return;
+  }
+
+  // The reserved slot owns the alarm before anyone can find it
+  atomic_init(&alarm->owner, slot);
+  // Link the alarm into the list sorted by id, through the skip list
+  alarm_index_insert(alarm);
+  group_index_insert(alarm);
+  alarm->time = clock_now();
+  alarm->periods = 0;
+  alarm->expiration = alarm->time + alarm->seconds;
+  deadline_heap_push(alarm);
+  printf("Alarm(%d) Inserted by Main Thread %ld Into Alarm List at %ld: "
+         "Group(%d) %d %s\n",
+         alarm->alarm_id, pthread_self(), clock_now(), alarm->group,
+         alarm->seconds, alarm->message);
+  trace_event(TRACE_INSERTED, alarm, alarm->expiration);
+  // The monitor may change or remove the alarm as soon as the list is
+  // unlocked, keep what is needed after that
+  expiration = alarm->expiration;
+
+  // Unlock the alarm list semaphore
+  sem_post(&alarm_write_semaphore);
+
+  // Let the display thread print the alarm
+  publish_display_slot(slot, 1);
+  atomic_fetch_add(&alarms_inserted, 1);
+  // Signal the monitor if it sleeps too long, with the expiration read while
+  // the list was locked
+  notify_monitor(expiration);
+}
+
+void check_engine_invariants(long *display_errors, long *index_errors) {
+  alarm_t *alarm, *previous = NULL;
+  display_slot_t *owner;
+  int alarms = 0, grouped = 0, i;
+
+  start_reading();
+  for (alarm = alarm_list; alarm != NULL; alarm = alarm->link) {
+    alarms++;
+    // The list is sorted and every alarm is in the skip list and the heap
+    if ((previous != NULL && previous->alarm_id >= alarm->alarm_id) ||
+        alarm_index_find(alarm->alarm_id) != alarm ||
+        alarm->heap_index < 0 || alarm->heap_index >= deadline_heap_size ||
+        deadline_heap[alarm->heap_index] != alarm) {
+      (*index_errors)++;
+    }
+    previous = alarm;
+
+    // Only the owner slot prints an alarm, it must be a slot of the alarm's
+    // group holding the alarm. Every alarm has one from its insertion on, and
+    // an owner keeps its slot from being emptied, so it can be read without
+    // the display list.
+    owner = atomic_load(&alarm->owner);
+    if (owner == NULL || owner->alarm_id != alarm->alarm_id ||
+        owner->context->alarm_group != alarm->group) {
+      (*display_errors)++;
+    }
+  }
+  for (i = 1; i < deadline_heap_size; i++) {
+    if (deadline_before(deadline_heap[i], deadline_heap[(i - 1) / 2])) {
+      (*index_errors)++;
+    }
+  }
+  for (i = 0; i < GROUP_TABLE_SIZE; i++) {
+    alarm_group_t *entry;
+    for (entry = group_table[i]; entry != NULL; entry = entry->next) {
+      grouped += entry->count;
+    }
+  }
+  if (deadline_heap_size != alarms || grouped != alarms) {
+    (*index_errors)++;
+  }
+  stop_reading();
+}
+
+int parse_stress_levels(const char *spec) {
+  const char *cursor = spec;
+  int producers, displays, consumed;
+
+  stress_level_count = 0;
+  while (sscanf(cursor, "%d:%d%n", &producers, &displays, &consumed) == 2) {
+    if (producers <= 0 || displays <= 0 ||
+        stress_level_count == STRESS_MAX_LEVELS) {
+      return -1;
+    }
+    stress_levels[stress_level_count].producers = producers;
+    stress_levels[stress_level_count++].displays = displays;
+    cursor += consumed;
+    if (*cursor == '\0') {
+      return 0;
+    }
+    if (*cursor++ != ',') {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+void *stress_producer(void *args) {
+  stress_producer_t *producer = args;
+  struct timespec start, end;
+  alarm_t *alarm;
+  int i;
+
+  for (i = 0; i < producer->ops; i++) {
+    alarm = malloc(sizeof(alarm_t));
+    if (alarm == NULL)
+      errno_abort("Allocate alarm");
+    alarm->alarm_id =
+        producer->id_base + rand_r(&producer->seed) % producer->id_range;
+    alarm->group = rand_r(&producer->seed) % producer->groups;
+    alarm->seconds = 1 + rand_r(&producer->seed) % 30;
+    alarm->periodic = 0;
+    alarm->repeat = 0;
+    snprintf(alarm->message, sizeof(alarm->message), "Stress_%d_%d",
+             producer->index, i);
+
+    // Seven in ten requests start an alarm, the rest change one
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (rand_r(&producer->seed) % 10 < 7) {
+      insert_alarm(alarm);
+    } else {
+      insert_alarm_changed(alarm);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    producer->latencies[i] = (end.tv_sec - start.tv_sec) * 1e6 +
+                             (end.tv_nsec - start.tv_nsec) / 1e3;
+    atomic_fetch_add(&stress_progress, 1);
+
+    if ((i + 1) % producer->batch == 0) {
+      // Let a simulated second pass so alarms expire and displays run
+      clock_sleep(1);
+      if (producer->index == 0) {
+        check_engine_invariants(&producer->display_errors,
+                                &producer->index_errors);
+        sem_wait(&display_list_semaphore);
+        if (admission.display_threads > producer->peak_displays) {
+          producer->peak_displays = admission.display_threads;
         }
+        sem_post(&display_list_semaphore);
       }
-      //Unlock the semaphore to write to the alarm list
-      sem_post(&alarm_write_semaphore);
     }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &producer->finished);
+  clock_leave();
+  return NULL;
+}
 
-    sem_post(&changed_alarm_semaphore);
+static int compare_latencies(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
 
-    // Variables to find the closest alarm for display
-    alarm_t *closest_alarm = NULL;
-    time_t closest_expiration_time = 0;
+  return x < y ? -1 : x > y;
+}
 
-    // Lock the semaphore to prevent changes while checking for the nearest
-    // alarm
-    start_reading();
-    // Check if there are alarms in the list
-    if (alarm_list != NULL) {
-      // Iterate through the alarm list to find the closest alarm
-      alarm_t *curr_alarm = alarm_list;
-      closest_alarm = curr_alarm;
-      closest_expiration_time = curr_alarm->time + curr_alarm->seconds;
-
-      while (curr_alarm != NULL) {
-        time_t expiration_time = curr_alarm->time + curr_alarm->seconds;
-        if (expiration_time < closest_expiration_time) {
-          closest_alarm = curr_alarm;
-          closest_expiration_time = expiration_time;
-        }
-        curr_alarm = curr_alarm->link;
+int run_stress() {
+  stress_producer_t *producers;
+  struct timespec start, end;
+  double *latencies, seconds;
+  long inserted, removed, rejected, lost, display_errors, index_errors, target;
+  long last_progress;
+  int level, i, ops, count, stalled, max_displays, failed = 0;
+
+  fprintf(stderr, "Producers,Displays,Requests,Seconds,Requests/s,p50 us,"
+                  "p99 us,Max us,Peak Display Threads,Rejected,Lost,"
+                  "Display Errors,Index Errors\n");
+  for (level = 0; level < stress_level_count; level++) {
+    stress_level_t *config = &stress_levels[level];
+    ops = stress_ops / config->producers > 0 ? stress_ops / config->producers
+                                             : 1;
+    producers = calloc(config->producers, sizeof(stress_producer_t));
+    if (producers == NULL)
+      errno_abort("Allocate producers");
+    inserted = atomic_load(&alarms_inserted);
+    removed = atomic_load(&alarms_removed);
+    rejected = atomic_load(&admission.rejected_displays);
+    target = atomic_load(&stress_progress) + (long)ops * config->producers;
+
+    // The level runs with at most its number of display threads, alarms
+    // that cannot be given one are rejected
+    sem_wait(&display_list_semaphore);
+    max_displays = admission.max_display_threads;
+    admission.max_display_threads = config->displays;
+    sem_post(&display_list_semaphore);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < config->producers; i++) {
+      stress_producer_t *producer = &producers[i];
+      producer->index = i;
+      producer->ops = ops;
+      producer->groups = config->displays;
+      // Enough requests per second to keep about two alarms per display
+      producer->batch = config->displays / (5 * config->producers);
+      if (producer->batch < 1) {
+        producer->batch = 1;
       }
-    }
-    // Release the semaphore after finding the nearest alarm
-    stop_reading();
-    int sleep_seconds = 0;
-
-    if (closest_alarm != NULL) {
-      // Calculate the time to sleep until the closest alarm
-      sleep_seconds = closest_expiration_time - time(NULL);
-      if (sleep_seconds < 0) {
-        // If the alarm is already expired, set sleep time to 0
-        sleep_seconds = 0;
+      producer->id_range = 4 * config->displays / config->producers;
+      if (producer->id_range < 16) {
+        producer->id_range = 16;
       }
+      producer->id_base = i * producer->id_range;
+      producer->seed = level * 7919 + i + 1;
+      producer->latencies = malloc(ops * sizeof(double));
+      if (producer->latencies == NULL)
+        errno_abort("Allocate latencies");
+      clock_join();
+      if (pthread_create(&producer->thread, NULL, stress_producer, producer) !=
+          0)
+        errno_abort("Create producer");
     }
 
-    if (sleep_seconds > 0) {
-      struct timespec sleep_time = {sleep_seconds, 0};
-
-      // Wait for either the nearest alarm or a signal indicating a change
-      int result = sem_timedwait(&monitor_semaphore, &sleep_time);
-
-      if (result == -1 && errno != ETIMEDOUT) {
-        perror("Semaphore wait error");
+    // Stop driving the clock while waiting, and watch for a stalled engine
+    clock_leave();
+    last_progress = -1;
+    stalled = 0;
+    while (atomic_load(&stress_progress) < target) {
+      usleep(100000);
+      if (atomic_load(&stress_progress) == last_progress && ++stalled == 100) {
+        fprintf(stderr, "Stress Level Producers(%d) Displays(%d) Stalled "
+                        "After %ld Requests\n",
+                config->producers, config->displays,
+                atomic_load(&stress_progress));
+        exit(1);
+      }
+      if (atomic_load(&stress_progress) != last_progress) {
+        stalled = 0;
       }
+      last_progress = atomic_load(&stress_progress);
     }
-    //Check if there are alarms in the list that could have expired
-    if(alarm_list != NULL){
-      process_expired_alarms();
-    }else{
-      // If there are no alarms in the list, wait on the monitor semaphore
-      sem_wait(&monitor_semaphore);
+    // The level took until its slowest producer finished
+    end = start;
+    for (i = 0; i < config->producers; i++) {
+      pthread_join(producers[i].thread, NULL);
+      if (producers[i].finished.tv_sec > end.tv_sec ||
+          (producers[i].finished.tv_sec == end.tv_sec &&
+           producers[i].finished.tv_nsec > end.tv_nsec)) {
+        end = producers[i].finished;
+      }
+    }
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Let every alarm expire, then nothing may be left over
+    clock_join();
+    clock_wait_idle();
+    display_errors = producers[0].display_errors;
+    index_errors = producers[0].index_errors;
+    check_engine_invariants(&display_errors, &index_errors);
+    lost = (atomic_load(&alarms_inserted) - inserted) -
+           (atomic_load(&alarms_removed) - removed);
+    rejected = atomic_load(&admission.rejected_displays) - rejected;
+    sem_wait(&display_list_semaphore);
+    admission.max_display_threads = max_displays;
+    sem_post(&display_list_semaphore);
+    if (alarm_list != NULL || display_alarm_threads != NULL) {
+      index_errors++;
     }
+
+    // Latency percentiles over every request of the level
+    count = ops * config->producers;
+    latencies = malloc(count * sizeof(double));
+    if (latencies == NULL)
+      errno_abort("Allocate latencies");
+    for (i = 0; i < config->producers; i++) {
+      memcpy(latencies + i * ops, producers[i].latencies, ops * sizeof(double));
+      free(producers[i].latencies);
+    }
+    qsort(latencies, count, sizeof(double), compare_latencies);
+
+    fprintf(stderr, "%d,%d,%d,%.3f,%.0f,%.1f,%.1f,%.1f,%d,%ld,%ld,%ld,%ld\n",
+            config->producers, config->displays, count, seconds,
+            count / seconds, latencies[count / 2],
+            latencies[(int)(count * 0.99)], latencies[count - 1],
+            producers[0].peak_displays, rejected, lost, display_errors,
+            index_errors);
+    if (lost != 0 || display_errors != 0 || index_errors != 0) {
+      failed = 1;
+    }
+    free(latencies);
+    free(producers);
   }
+  return failed;
 }
 
-void process_expired_alarms() {
-  time_t current_time = time(NULL);
-
-  // Lock the semaphore to access the alarm list
-  sem_wait(&alarm_write_semaphore);
-  alarm_t *prev = NULL;
-  alarm_t *current = alarm_list;
-
-  while (current != NULL) {
-    time_t expiration_time = current->time + current->seconds;
+int drain_alarms() {
+  alarm_t *alarm;
+  time_t last, end, now;
+  int unbounded, pending;
 
-    if (expiration_time <= current_time) {
-      // Remove the expired alarm from the list
-      if (prev == NULL) {
-        alarm_list = current->link;
-      } else {
-        prev->link = current->link;
+  while (1) {
+    // Find when the last alarm that can expire is removed
+    last = 0;
+    unbounded = 0;
+    start_reading();
+    for (alarm = alarm_list; alarm != NULL; alarm = alarm->link) {
+      if (alarm->periodic && alarm->repeat == 0) {
+        unbounded++;
+        continue;
       }
+      end = alarm->periodic
+                ? alarm->time + (time_t)alarm->repeat * alarm->seconds
+                : alarm->expiration;
+      if (end > last) {
+        last = end;
+      }
+    }
+    stop_reading();
+    sem_wait(&changed_alarm_semaphore);
+    pending = admission.pending_changes;
+    sem_post(&changed_alarm_semaphore);
 
-      printf("Alarm Monitor Thread %ld Has Removed Alarm(%d) at %ld: "
-             "Group(%d) %d %s\n",
-             pthread_self(), current->alarm_id, current_time, current->group,
-             current->seconds, current->message);
-
-      free(current);
-      current = (prev == NULL) ? alarm_list : prev->link;
+    if (last == 0 && pending == 0) {
+      return unbounded;
+    }
+    // A change may restart an alarm, look again once these are done
+    now = clock_now();
+    if (last > now) {
+      clock_sleep(last - now);
+    } else if (clock_source == CLOCK_SOURCE_SIMULATED) {
+      // The monitor is due now and time stands still until it waits again
+      sched_yield();
     } else {
-      prev = current;
-      current = current->link;
+      clock_sleep(1);
     }
   }
-
-  // Release the semaphore after processing expired alarms
-  sem_post(&alarm_write_semaphore);
 }
 
-void insert_alarm_changed(alarm_t *alarm) {
-  int status;
-  alarm_t **last, *next;
+void replay_wait_until(time_t logged_time) {
+  static int rebased = 0;
+  static time_t offset;
+  time_t now = clock_now();
 
-  // Lock the changed alarms list mutex
-  status = sem_wait(&changed_alarm_semaphore);
-  if (status != 0) {
-    err_abort(status, "Lock mutex");
+  // The first replayed line is issued immediately, later ones keep the
+  // spacing they had in the captured log
+  if (!rebased) {
+    offset = now - logged_time;
+    rebased = 1;
   }
+  if (logged_time + offset > now) {
+    clock_sleep(logged_time + offset - now);
+  }
+}
 
-  // Initialize pointers for traversal in the changed alarms list
-  last = &changed_alarm_list;
-  next = *last;
+/* Time of the engine clock in nanoseconds, finer than clock_now() */
+static int64_t trace_now_ns() {
+  struct timespec now;
 
-  while (next != NULL) {
-    if (alarm->alarm_id < next->alarm_id) {
-      // Insert before next in the changed alarms list
-      alarm->link = next;
-      *last = alarm;
-      break;
-    } else {
-      // Move to the next item in the changed alarms list
-      last = &next->link;
-      next = *last;
-    }
+  if (clock_source == CLOCK_SOURCE_SIMULATED) {
+    return (int64_t)clock_now() * 1000000000;
   }
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-  // If we reach the end of the list, insert the alarm into changed alarms
-  if (next == NULL) {
-    *last = alarm;
-    alarm->link = NULL;
+/* Append a record (and its text, if any) to a trace held in memory */
+static void trace_append(trace_log_t *log, const trace_record_t *record,
+                         char *text) {
+  if (log->count == log->capacity) {
+    log->capacity = log->capacity == 0 ? 256 : log->capacity * 2;
+    log->records =
+        realloc(log->records, log->capacity * sizeof(trace_record_t));
+    log->texts = realloc(log->texts, log->capacity * sizeof(char *));
+    if (log->records == NULL || log->texts == NULL)
+      errno_abort("Allocate trace");
   }
-  alarm->time = time(NULL);
-  printf("Change Alarm Request(%d) Inserted by Main Thread %ld into Alarm List "
-         "at %ld: Group(%d) %d %s\n",
-         alarm->alarm_id, pthread_self(), time(NULL), alarm->group,
-         alarm->seconds, alarm->message);
-
-  // Unlock the changed alarms list mutex
-  sem_post(&changed_alarm_semaphore);
-  sem_post(&monitor_semaphore);
+  log->records[log->count] = *record;
+  log->texts[log->count] = text;
+  log->count++;
 }
 
-void check_or_create_display_thread(alarm_t *alarm, int taken_over) {
-  int status;
-  display_alarm_info_t *new_display_thread = NULL;
-
-  sem_wait(&display_list_semaphore); // Lock to ensure thread safety
+int trace_open(const char *path) {
+  trace_header_t header = {TRACE_MAGIC, TRACE_VERSION, 0, 0};
 
-  // Check if a display thread for the group already exists
-  display_alarm_info_t *current = display_alarm_threads;
-  while (current != NULL) {
-    if (current->alarm_group == alarm->group && current->alarms_in_group < 2) {
-      // Found a display thread assigned to the group with an empty slot
-      if (current->alarm1 == -1) {
-        // Slot 1 is empty, assign the alarm_id to alarm1
-        current->alarm1 = alarm->alarm_id;
-        current->alarm1_taken_over = taken_over;
-        strcpy(current->alarm1_message, alarm->message);
-      } else {
-        // Slot 2 is empty, assign the alarm_id to alarm2
-        current->alarm2 = alarm->alarm_id;
-        current->alarm2_taken_over = taken_over;
-        strcpy(current->alarm2_message, alarm->message);
-      }
-      current->alarms_in_group++; // Increment the count of alarms in the group
-      // Print the creation message
-      printf("Main Thread %lu Assigned to Display Alarm Thread %lu at %ld: "
-             "Group(%d) %d %s\n",
-             pthread_self(), current->thread, time(NULL), alarm->group,
-             alarm->seconds, alarm->message);
-      sem_post(&display_list_semaphore);
-      return;
-    }
-    current = current->next; // Move to the next display thread
+  trace_file = fopen(path, "wb");
+  if (trace_file == NULL) {
+    return -1;
   }
+  header.clock_source = clock_source;
+  if (fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+    fclose(trace_file);
+    trace_file = NULL;
+    return -1;
+  }
+  return 0;
+}
 
-  // No available display thread for the group, create a new one
-  new_display_thread = malloc(sizeof(display_alarm_info_t));
-  if (new_display_thread == NULL) {
-    // Handle memory allocation failure
-    sem_post(&display_list_semaphore); // Unlock before returning
+void trace_command(const char *line) {
+  trace_record_t record = {TRACE_COMMAND, 0, 0, -1, 0, 0, 0, 0};
+  size_t length = strcspn(line, "\n");
+
+  if (trace_file == NULL) {
     return;
   }
+  record.length = length;
+  record.time_ns = trace_now_ns();
+  pthread_mutex_lock(&trace_mutex);
+  fwrite(&record, sizeof(record), 1, trace_file);
+  fwrite(line, 1, length, trace_file);
+  // Keep the trace usable if the program is interrupted
+  fflush(trace_file);
+  pthread_mutex_unlock(&trace_mutex);
+}
 
-  // Initialize the new display thread
-  new_display_thread->alarm_group = alarm->group;
-  new_display_thread->alarms_in_group = 1;
-  new_display_thread->alarm1 = alarm->alarm_id;
-  new_display_thread->alarm1_taken_over = taken_over;
-  strcpy(new_display_thread->alarm1_message, alarm->message);
+void trace_event(trace_type_t type, alarm_t *alarm, time_t expiration) {
+  trace_record_t record = {0, 0, 0, 0, 0, 0, 0, 0};
 
-  new_display_thread->alarm2 = -1; // Initialize to -1 indicating an empty slot
-  new_display_thread->alarm2_taken_over = -1;
+  if (trace_file == NULL && !trace_capturing) {
+    return;
+  }
+  record.type = type;
+  record.alarm_id = alarm->alarm_id;
+  record.group = alarm->group;
+  record.seconds = alarm->seconds;
+  record.time_ns = trace_now_ns();
+  record.expiration = expiration;
+  pthread_mutex_lock(&trace_mutex);
+  if (trace_file != NULL) {
+    fwrite(&record, sizeof(record), 1, trace_file);
+    // Keep the trace usable if the program is interrupted
+    fflush(trace_file);
+  }
+  if (trace_capturing) {
+    trace_append(&trace_capture, &record, NULL);
+  }
+  pthread_mutex_unlock(&trace_mutex);
+}
 
-  // Add the new display thread at the beginning of the list
-  new_display_thread->next = display_alarm_threads;
-  display_alarm_threads = new_display_thread;
+/* Read a whole trace file into memory */
+static int trace_load(const char *path, trace_log_t *log,
+                      trace_header_t *header) {
+  trace_record_t record;
+  char *text;
+  FILE *file = fopen(path, "rb");
 
-  /* Create new thread */
-  status =
-      pthread_create(&new_display_thread->thread, NULL, display_alarm, NULL);
-  if (status != 0) {
-    // Handle thread creation failure
-    free(new_display_thread);          // Free memory in case of failure
-    sem_post(&display_list_semaphore); // Unlock before returning
-    return;
+  if (file == NULL) {
+    fprintf(stderr, "Cannot open trace %s\n", path);
+    return -1;
+  }
+  if (fread(header, sizeof(*header), 1, file) != 1 ||
+      header->magic != TRACE_MAGIC || header->version != TRACE_VERSION) {
+    fprintf(stderr, "%s is not a version %d alarm trace\n", path,
+            TRACE_VERSION);
+    fclose(file);
+    return -1;
+  }
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    text = NULL;
+    if (record.type == 0 || record.type >= TRACE_TYPE_COUNT) {
+      fprintf(stderr, "Bad record in trace %s\n", path);
+      fclose(file);
+      return -1;
+    }
+    if (record.type == TRACE_COMMAND) {
+      text = malloc(record.length + 1);
+      if (text == NULL)
+        errno_abort("Allocate trace");
+      if (fread(text, 1, record.length, file) != record.length) {
+        // A command cut short by an interrupted recording ends the trace
+        free(text);
+        break;
+      }
+      text[record.length] = '\0';
+    }
+    trace_append(log, &record, text);
   }
+  fclose(file);
+  return 0;
+}
 
-  // Print the creation message
-  printf("Main Thread Created New Display Alarm Thread %lu For Alarm(%d) at "
-         "%ld: Group(%d) %d %s\n",
-         new_display_thread->thread, alarm->alarm_id, time(NULL), alarm->group,
-         alarm->seconds, alarm->message);
-  sem_post(&display_list_semaphore); // Unlock before returning
+static int compare_trace_keys(const void *a, const void *b) {
+  const trace_key_t *x = a, *y = b;
+
+  if (x->type != y->type)
+    return x->type < y->type ? -1 : 1;
+  if (x->alarm_id != y->alarm_id)
+    return x->alarm_id < y->alarm_id ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
 }
 
-void insert_alarm(alarm_t *alarm) {
-  int status;
-  alarm_t **last, *next;
+/* Events of a trace sorted by kind, alarm and the order they were written */
+static trace_key_t *trace_sort_events(trace_log_t *log, int *count) {
+  trace_key_t *keys = malloc((log->count + 1) * sizeof(trace_key_t));
+  int i;
+
+  if (keys == NULL)
+    errno_abort("Allocate replay");
+  *count = 0;
+  for (i = 0; i < log->count; i++) {
+    if (log->records[i].type != TRACE_COMMAND) {
+      keys[*count].type = log->records[i].type;
+      keys[*count].alarm_id = log->records[i].alarm_id;
+      keys[*count].index = i;
+      (*count)++;
+    }
+  }
+  qsort(keys, *count, sizeof(trace_key_t), compare_trace_keys);
+  return keys;
+}
 
-  // lock the alarm list mutex
-  status = sem_wait(&alarm_write_semaphore);
-  if (status != 0) {
-    err_abort(status, "Lock semap");
+/* Sleep on the simulated clock until seconds after a replay started */
+static void trace_wait_until(time_t base, time_t seconds) {
+  time_t now = clock_now();
+
+  if (base + seconds > now) {
+    clock_sleep(base + seconds - now);
   }
+}
 
-  // last is the header of list, next is the first element in list
-  last = &alarm_list;
-  next = *last;
+int run_replay(const char *path) {
+  trace_log_t recorded = {NULL, NULL, 0, 0};
+  trace_header_t header;
+  trace_record_t *original, *replayed;
+  int64_t recorded_start = -1, replay_start = 0, last_offset = 0, tolerance;
+  int64_t offset, original_late, replay_late;
+  int64_t original_late_max = 0, replay_late_max = 0;
+  double original_late_sum = 0, replay_late_sum = 0;
+  trace_key_t *recorded_keys, *replayed_keys;
+  int *match, *used;
+  int commands = 0, events = 0, matched = 0, extra = 0, retimed = 0;
+  int late_count = 0, recorded_events, replayed_events, i, j, order;
+  struct timespec start, wake;
+  time_t replay_base;
+  char line[256];
+
+  if (trace_load(path, &recorded, &header) != 0) {
+    return 1;
+  }
+  for (i = 0; i < recorded.count; i++) {
+    if (recorded.records[i].type == TRACE_COMMAND && recorded_start < 0) {
+      recorded_start = recorded.records[i].time_ns;
+    }
+  }
+  for (i = 0; i < recorded.count && recorded_start >= 0; i++) {
+    offset = recorded.records[i].time_ns - recorded_start;
+    last_offset = offset > last_offset ? offset : last_offset;
+  }
 
-  while (next != NULL) {
-    if (alarm->alarm_id == next->alarm_id) {
-      // An alarm with the same ID already exists, don't insert the new alarm
-      printf("An alarm with ID %d already exists.\n", alarm->alarm_id);
-      free(alarm); // Free the new alarm
-      sem_post(&alarm_write_semaphore);
-      return; // Return without inserting the new alarm
-    } else if (alarm->alarm_id < next->alarm_id) {
-      // Insert before next, update header
-      alarm->link = next;
-      *last = alarm;
-      break;
+  trace_capturing = 1;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  replay_start = trace_now_ns();
+  replay_base = clock_now();
+  for (i = 0; i < recorded.count; i++) {
+    if (recorded.records[i].type != TRACE_COMMAND) {
+      events++;
+      continue;
+    }
+    // Keep the spacing the commands had when they were recorded
+    offset = recorded.records[i].time_ns - recorded_start;
+    if (clock_source == CLOCK_SOURCE_SIMULATED) {
+      trace_wait_until(replay_base, offset / 1000000000);
     } else {
-      // Move to the next item
-      last = &next->link;
-      next = *last;
+      wake.tv_sec = start.tv_sec + (start.tv_nsec + offset) / 1000000000;
+      wake.tv_nsec = (start.tv_nsec + offset) % 1000000000;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) ==
+             EINTR)
+        ;
     }
+    snprintf(line, sizeof(line), "%s\n", recorded.texts[i]);
+    printf("Alarm>\n");
+    trace_command(line);
+    process_command(line);
+    fflush(stdout);
+    commands++;
   }
 
-  /*
-   * If we reach the end of the list, insert the alarm there, next == NULL,
-   * and last points to the last item or the list header.
-   */
-  if (next == NULL) {
-    *last = alarm;
-    alarm->link = NULL;
+  // Give the engine the rest of the recorded run and a few seconds more to
+  // produce its events, leaving early once nothing is scheduled
+  if (clock_source == CLOCK_SOURCE_SIMULATED) {
+    trace_wait_until(replay_base, last_offset / 1000000000 + 5);
+  } else {
+    while (trace_now_ns() - replay_start < last_offset + 5000000000LL) {
+      sem_wait(&changed_alarm_semaphore);
+      j = admission.pending_changes == 0;
+      sem_post(&changed_alarm_semaphore);
+      start_reading();
+      j = j && deadline_heap_size == 0;
+      stop_reading();
+      if (j && trace_now_ns() - replay_start >= last_offset) {
+        break;
+      }
+      wake.tv_sec = 0;
+      wake.tv_nsec = 100000000;
+      nanosleep(&wake, NULL);
+    }
+  }
+  pthread_mutex_lock(&trace_mutex);
+  trace_capturing = 0;
+  pthread_mutex_unlock(&trace_mutex);
+
+  // Match events by kind, alarm and occurrence, whichever order they came in.
+  // Sorted by kind and alarm, the n-th event about an alarm in one trace
+  // meets the n-th one in the other.
+  match = malloc((recorded.count + 1) * sizeof(int));
+  used = calloc(trace_capture.count + 1, sizeof(int));
+  if (match == NULL || used == NULL)
+    errno_abort("Allocate replay");
+  for (i = 0; i < recorded.count; i++) {
+    match[i] = -1;
+  }
+  recorded_keys = trace_sort_events(&recorded, &recorded_events);
+  replayed_keys = trace_sort_events(&trace_capture, &replayed_events);
+  for (i = 0, j = 0; i < recorded_events && j < replayed_events;) {
+    order = recorded_keys[i].type != replayed_keys[j].type
+                ? recorded_keys[i].type - replayed_keys[j].type
+                : (recorded_keys[i].alarm_id > replayed_keys[j].alarm_id) -
+                      (recorded_keys[i].alarm_id < replayed_keys[j].alarm_id);
+    if (order < 0) {
+      i++;
+    } else if (order > 0) {
+      j++;
+    } else {
+      match[recorded_keys[i].index] = replayed_keys[j].index;
+      used[replayed_keys[j].index] = 1;
+      i++;
+      j++;
+    }
+  }
+  free(recorded_keys);
+  free(replayed_keys);
+  // Both runs on the simulated clock must agree to the second, otherwise
+  // events may land on either side of a second boundary
+  tolerance = header.clock_source == CLOCK_SOURCE_SIMULATED &&
+                      clock_source == CLOCK_SOURCE_SIMULATED
+                  ? 0
+                  : 1000000000;
+  for (i = 0; i < recorded.count; i++) {
+    original = &recorded.records[i];
+    if (original->type == TRACE_COMMAND) {
+      continue;
+    }
+    if (match[i] < 0) {
+      printf("Replay Missing Event %d for Alarm(%d) at %+.3f Seconds\n",
+             original->type, original->alarm_id,
+             (original->time_ns - recorded_start) / 1e9);
+      continue;
+    }
+    replayed = &trace_capture.records[match[i]];
+    matched++;
+    offset = (replayed->time_ns - replay_start) -
+             (original->time_ns - recorded_start);
+    if (offset > tolerance || offset < -tolerance) {
+      retimed++;
+      printf("Replay Retimed Event %d for Alarm(%d) by %+.3f Seconds\n",
+             original->type, original->alarm_id, offset / 1e9);
+    }
+    if (original->type == TRACE_FIRED || original->type == TRACE_REMOVED) {
+      // Lateness is how long after its scheduled expiration an alarm fired
+      original_late = original->time_ns - original->expiration * 1000000000;
+      replay_late = replayed->time_ns - replayed->expiration * 1000000000;
+      original_late_sum += original_late;
+      replay_late_sum += replay_late;
+      if (original_late > original_late_max)
+        original_late_max = original_late;
+      if (replay_late > replay_late_max)
+        replay_late_max = replay_late;
+      late_count++;
+    }
+  }
+  // The recording ends with its last record, so an event the replay produced
+  // later (such as another firing of a periodic alarm without a repeat
+  // count) has nothing to be compared with
+  for (j = 0; j < trace_capture.count; j++) {
+    if (!used[j] &&
+        trace_capture.records[j].time_ns - replay_start <= last_offset) {
+      extra++;
+      printf("Replay Extra Event %d for Alarm(%d) at %+.3f Seconds\n",
+             trace_capture.records[j].type, trace_capture.records[j].alarm_id,
+             (trace_capture.records[j].time_ns - replay_start) / 1e9);
+    }
   }
-  alarm->time = time(NULL);
-  printf("Alarm(%d) Inserted by Main Thread %ld Into Alarm List at %ld: "
-         "Group(%d) %d %s\n",
-         alarm->alarm_id, pthread_self(), time(NULL), alarm->group,
-         alarm->seconds, alarm->message);
 
-  // Unlock the alarm list semaphore
-  sem_post(&alarm_write_semaphore);
+  printf("Replay Finished at %ld: %d Commands, %d Events Matched, %d "
+         "Missing, %d Extra, %d Retimed\n",
+         clock_now(), commands, matched, events - matched,
+         extra, retimed);
+  if (late_count > 0) {
+    printf("Replay Lateness: Original Mean %.1f ms Max %.1f ms, Replay Mean "
+           "%.1f ms Max %.1f ms\n",
+           original_late_sum / late_count / 1e6, original_late_max / 1e6,
+           replay_late_sum / late_count / 1e6, replay_late_max / 1e6);
+  }
+  fflush(stdout);
+  free(match);
+  free(used);
+  return matched == events && extra == 0 && retimed == 0 ? 0 : 1;
+}
+
+int validate_alarm(const alarm_t *alarm) {
+  int valid = 1;
+
+  if (alarm->alarm_id < 0) {
+    fprintf(stderr, "Alarm ID must be greater than or equal to 0\n");
+    valid = 0;
+  }
+  if (alarm->seconds <= 0) {
+    fprintf(stderr, alarm->periodic ? "Alarm period must be greater than 0\n"
+                                    : "Alarm time must be greater than 0\n");
+    valid = 0;
+  }
+  if (alarm->group < 0) {
+    fprintf(stderr, "Group ID must be greater than or equal to 0\n");
+    valid = 0;
+  }
+  if (alarm->repeat < 0) {
+    fprintf(stderr, "Repeat count must be greater than or equal to 0\n");
+    valid = 0;
+  }
+  return valid;
+}
+
+void process_command(char *line) {
+  alarm_t *alarm;
+  time_t logged_time;
+  int seconds, first_id, last_id, group, repeat, fields;
 
-  // Check if a display thread needs to be created or an existing one can be
-  // used
-  check_or_create_display_thread(alarm, 0);
-  sem_post(&monitor_semaphore); // signal monitor
+  // Allocate new alarm
+  alarm = (alarm_t *)malloc(sizeof(alarm_t));
+  if (alarm == NULL)
+    errno_abort("Allocate alarm");
+  alarm->periodic = 0;
+  alarm->repeat = 0;
+
+  /*
+   * Parse input line into alarm_id (%d), seconds (%d), and a message
+   * (%128[^\n]), consisting of up to 128 characters separated by
+   * whitespace.
+   */
+  // COMMAND 1: Start_Alarm
+  if (sscanf(line, "Start_Alarm(%d): Group(%d) %d %128[^\n]",
+             &alarm->alarm_id, &alarm->group, &alarm->seconds,
+             alarm->message) == 4) {
+    if (validate_alarm(alarm)) {
+      // Insert the new alarm into the list of alarms, sorted by alarm id
+      insert_alarm(alarm);
+    } else {
+      // Free the invalid alarm
+      free(alarm);
+    }
+  }
+  // COMMAND 1b: Start_Periodic_Alarm, with or without a repeat count
+  else if ((fields = sscanf(line,
+                            "Start_Periodic_Alarm(%d): Group(%d) %d "
+                            "Repeat(%d) %128[^\n]",
+                            &alarm->alarm_id, &alarm->group, &alarm->seconds,
+                            &repeat, alarm->message)) == 5 ||
+           sscanf(line, "Start_Periodic_Alarm(%d): Group(%d) %d %128[^\n]",
+                  &alarm->alarm_id, &alarm->group, &alarm->seconds,
+                  alarm->message) == 4) {
+    // A repeat count only counts when the whole line matched with it,
+    // otherwise "Repeat(n)" is the message
+    alarm->repeat = fields == 5 ? repeat : 0;
+    // The alarm re-arms itself every seconds until removed
+    alarm->periodic = 1;
+    if (validate_alarm(alarm)) {
+      insert_alarm(alarm);
+    } else {
+      free(alarm);
+    }
+  }
+  // COMMAND 2: Change Alarm
+  else if (sscanf(line, "Change_Alarm(%d): Group(%d) %d %128[^\n]",
+                  &alarm->alarm_id, &alarm->group, &alarm->seconds,
+                  alarm->message) == 4) {
+    if (validate_alarm(alarm)) {
+      // Replace the alarm once the monitor thread applies the request
+      insert_alarm_changed(alarm);
+    } else {
+      // Free the invalid change request
+      free(alarm);
+    }
+  }
+  // COMMAND 3: Show_Stats
+  else if (strncmp(line, "Show_Stats", 10) == 0) {
+    free(alarm);
+    print_stats();
+  }
+  // COMMAND 4: Advance_Clock, pause the input for a number of seconds
+  else if (sscanf(line, "Advance_Clock(%d)", &seconds) == 1) {
+    free(alarm);
+    if (seconds > 0) {
+      clock_sleep(seconds);
+      printf("Main Thread %lu Advanced Clock to %ld\n", pthread_self(),
+             clock_now());
+    } else {
+      fprintf(stderr, "Clock advance must be greater than 0\n");
+    }
+  }
+  // COMMAND 5: List_Alarms, List_Group and List_Expiring
+  else if (sscanf(line, "List_Alarms(%d-%d)", &first_id, &last_id) == 2) {
+    free(alarm);
+    list_alarms_by_id(first_id, last_id);
+  } else if (sscanf(line, "List_Group(%d)", &group) == 1 && group >= 0) {
+    free(alarm);
+    list_alarms_by_group(group);
+  } else if (sscanf(line, "List_Expiring(%d)", &seconds) == 1 &&
+             seconds >= 0) {
+    free(alarm);
+    list_alarms_by_deadline(seconds);
+  }
+  // Replayed log lines, reissued with the spacing they were captured with
+  // and checked like the commands they were logged for
+  else if (sscanf(line,
+                  "Alarm(%d) Inserted by Main Thread %*u Into Alarm List "
+                  "at %ld: Group(%d) %d %128[^\n]",
+                  &alarm->alarm_id, &logged_time, &alarm->group,
+                  &alarm->seconds, alarm->message) == 5) {
+    replay_wait_until(logged_time);
+    if (validate_alarm(alarm)) {
+      insert_alarm(alarm);
+    } else {
+      free(alarm);
+    }
+  } else if (sscanf(line,
+                    "Change Alarm Request(%d) Inserted by Main Thread %*u "
+                    "into Alarm List at %ld: Group(%d) %d %128[^\n]",
+                    &alarm->alarm_id, &logged_time, &alarm->group,
+                    &alarm->seconds, alarm->message) == 5) {
+    replay_wait_until(logged_time);
+    if (validate_alarm(alarm)) {
+      insert_alarm_changed(alarm);
+    } else {
+      free(alarm);
+    }
+  } else {
+    fprintf(stderr, "Bad command\n");
+    free(alarm); // Free the invalid alarm
+  }
 }
 
 int main(int argc, char *argv[]) {
   int status;
-  char line[128];
-  alarm_t *alarm;
-  pthread_t monitor_thread;
+  char line[256];
+  time_t start_time;
+  struct timespec wall_start, wall_end;
+  int i, unbounded;
+  const char *trace_path = NULL, *replay_path = NULL;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--simulate") == 0) {
+      clock_source = CLOCK_SOURCE_SIMULATED;
+    } else if ((strcmp(argv[i], "-c") == 0 ||
+                strcmp(argv[i], "--max-catch-up") == 0) &&
+               i + 1 < argc && atoi(argv[i + 1]) > 0) {
+      max_catch_up = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max-alarms") == 0 && i + 1 < argc &&
+               atoi(argv[i + 1]) > 0) {
+      admission.max_alarms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max-changes") == 0 && i + 1 < argc &&
+               atoi(argv[i + 1]) > 0) {
+      admission.max_pending_changes = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max-displays") == 0 && i + 1 < argc &&
+               atoi(argv[i + 1]) > 0) {
+      admission.max_display_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--admission-wait") == 0 && i + 1 < argc &&
+               atoi(argv[i + 1]) >= 0) {
+      admission.wait_seconds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--stress") == 0 && i + 1 < argc &&
+               parse_stress_levels(argv[i + 1]) == 0) {
+      // Stress runs always use the simulated clock
+      clock_source = CLOCK_SOURCE_SIMULATED;
+      i++;
+    } else if (strcmp(argv[i], "--stress-ops") == 0 && i + 1 < argc &&
+               atoi(argv[i + 1]) > 0) {
+      stress_ops = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if ((strcmp(argv[i], "-p") == 0 ||
+                strcmp(argv[i], "--placement") == 0) &&
+               i + 1 < argc && parse_thread_placement(argv[i + 1]) == 0) {
+      i++;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [-s|--simulate] [-c|--max-catch-up n]\n"
+              "       [-p|--placement role:cpus=LIST,node=N,stack=BYTES,"
+              "priority=P]...\n"
+              "       [--max-alarms n] [--max-changes n] [--max-displays n]"
+              " [--admission-wait seconds]\n"
+              "       [--stress producers:displays,...] [--stress-ops n]\n"
+              "       [--trace file] [--replay file]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+
+  // The virtual clock starts at the current wall time and the main thread is
+  // the first thread it tracks
+  virtual_now = time(NULL);
+  clock_join();
+  if (trace_path != NULL && trace_open(trace_path) != 0)
+    errno_abort("Create trace");
+  start_time = clock_now();
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
 
   // Initialize to 1 for mutual exclusion
   sem_init(&display_list_semaphore, 0, 1);
@@ -600,75 +2549,63 @@ int main(int argc, char *argv[]) {
   sem_init(&alarm_read_semaphore, 0, 1);
   sem_init(&changed_alarm_semaphore, 0, 1);
 
-  // Initialize to 0 for waiting
-  sem_init(&monitor_semaphore, 0, 0);
+  // Initialize to the number of change requests that may be pending
+  sem_init(&changed_slots_semaphore, 0, admission.max_pending_changes);
+
+  input_thread = pthread_self();
+  place_input_thread();
+  clock_join();
+  status = create_placed_thread(&monitor_thread, THREAD_ROLE_MONITOR,
+                                monitor_alarms, NULL);
+  if (status != 0)
+    err_abort(status, "Create monitor thread");
+
+  if (stress_level_count > 0) {
+    // Results go to stderr, the event log of a stress run is discarded
+    freopen("/dev/null", "w", stdout);
+    exit(run_stress());
+  }
 
-  pthread_create(&monitor_thread, NULL, monitor_alarms, NULL);
+  if (replay_path != NULL) {
+    exit(run_replay(replay_path));
+  }
 
   while (1) {
     printf("Alarm>\n");
-    if (fgets(line, sizeof(line), stdin) == NULL)
-      exit(0);
-    if (strlen(line) <= 1) {
-      continue;
-    }
-    // Allocate new alarm
-    alarm = (alarm_t *)malloc(sizeof(alarm_t));
-    if (alarm == NULL)
-      errno_abort("Allocate alarm");
-
-    /*
-     * Parse input line into alarm_id (%d), seconds (%d), and a message
-     * (%128[^\n]), consisting of up to 128 characters separated by
-     * whitespace.
-     */
-    // COMMAND 1: Start_Alarm
-    if (sscanf(line, "Start_Alarm(%d): Group(%d) %d %128[^\n]",
-               &alarm->alarm_id, &alarm->group, &alarm->seconds,
-               alarm->message) == 4) {
-      if (alarm->alarm_id >= 0 && alarm->seconds > 0 && alarm->group >= 0) {
-        // Valid alarm_id, seconds, and group, proceed with adding the alarm
-
-        // Insert the new alarm into the list of alarms, sorted by alarm id
-        insert_alarm(alarm);
-      } else {
-        // Invalid alarm_id or seconds
-        if (alarm->alarm_id < 0) {
-          fprintf(stderr, "Alarm ID must be greater than or equal to 0 0\n");
-        }
-        if (alarm->seconds <= 0) {
-          fprintf(stderr, "Alarm time must be greater than 0\n");
+    if (fgets(line, sizeof(line), stdin) == NULL) {
+      if (clock_source == CLOCK_SOURCE_SIMULATED) {
+        // Let the remaining alarms expire and the display threads exit,
+        // periodic alarms without a repeat count would run forever
+        unbounded = drain_alarms();
+        if (unbounded == 0) {
+          clock_wait_idle();
+        } else {
+          printf("Simulation Stopped at %ld: %d Periodic Alarms Without "
+                 "Repeat Left\n",
+                 clock_now(), unbounded);
         }
-        if (alarm->group < 0) {
-          fprintf(stderr, "Group ID must be greater than or equal to 0\n");
+        clock_gettime(CLOCK_MONOTONIC, &wall_end);
+        printf("Simulation Finished at %ld: %ld Virtual Seconds in %.3f Wall "
+               "Seconds\n",
+               clock_now(), clock_now() - start_time,
+               (wall_end.tv_sec - wall_start.tv_sec) +
+                   (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9);
+      } else if (trace_file != NULL) {
+        // Record the events of the alarms still running before exiting
+        unbounded = drain_alarms();
+        if (unbounded != 0) {
+          printf("Trace Stopped at %ld: %d Periodic Alarms Without Repeat "
+                 "Left\n",
+                 clock_now(), unbounded);
         }
-        // Free the invalid alarm
-        free(alarm);
       }
+      exit(0);
     }
-    // COMMAND 2: Change Alarm
-    else if (sscanf(line, "Change_Alarm(%d): Group(%d) %d %128[^\n]",
-                    &alarm->alarm_id, &alarm->group, &alarm->seconds,
-                    alarm->message) == 4) {
-      if (alarm->alarm_id >= 0 && alarm->seconds > 0 && alarm->group >= 0) {
-        // Valid alarm_id and seconds, proceed with replacing the alarm
-        insert_alarm_changed(alarm);
-      } else {
-        // Invalid alarm_id or seconds
-        if (alarm->alarm_id < 0) {
-          fprintf(stderr, "Alarm ID must be greater than or equal to 0\n");
-        }
-        if (alarm->seconds <= 0) {
-          fprintf(stderr, "Alarm time must be greater than 0\n");
-        }
-        if (alarm->group < 0) {
-          fprintf(stderr, "Group ID must be greater than or equal to 0\n");
-        }
-      }
-    } else {
-      fprintf(stderr, "Bad command\n");
-      free(alarm); // Free the invalid alarm
+    if (strlen(line) <= 1) {
+      continue;
     }
+    trace_command(line);
+    process_command(line);
     fflush(stdout); // Manually flush the stdout buffer
   }
 }
\ No newline at end of file
@@ -1,8 +1,33 @@
+// Needed for cpu_set_t and the pthread affinity calls
+#define _GNU_SOURCE
 #include "errors.h"
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
 #include <time.h>
 
+/** @brief Deadline used for clock waits that only end when signalled */
+#define CLOCK_NEVER ((time_t)LONG_MAX)
+
+/** @brief Number of buckets in the simulated clock's table of waiters */
+#define CLOCK_WAKEUP_TABLE_SIZE 1024
+
+/** @brief Number of levels in the alarm id skip list */
+#define ALARM_SKIP_LEVELS 16
+
+/** @brief Number of buckets in the alarm group table */
+#define GROUP_TABLE_SIZE 256
+
+/** @brief Number of alarms a List command copies per lock acquisition */
+#define LIST_PAGE_SIZE 32
+
+struct display_slot;
+
 /** @brief Structure to store information about each alarm */
 typedef struct alarm_tag {
   struct alarm_tag *link; /**< Pointer to the next alarm in the list */
@@ -11,22 +36,244 @@ typedef struct alarm_tag {
   int seconds;        /**< Seconds until the alarm goes off */
   time_t time;        /**< Time in seconds from EPOCH when the alarm is set */
   char message[128];  /**< Message associated with the alarm */
+  int periodic;       /**< Flag indicating the alarm re-arms every seconds */
+  int repeat;         /**< Number of periods before removal, 0 for no limit */
+  int periods;        /**< Number of periods that have elapsed so far */
+  time_t expiration;  /**< Time the alarm (or its next period) expires at */
+  int heap_index;     /**< Position of the alarm in the deadline heap */
+  int skip_levels;    /**< Number of skip list levels the alarm is linked in */
+  struct alarm_tag *skip[ALARM_SKIP_LEVELS]; /**< Next alarm on each level above
+                                                  link, which is level 0 */
+  struct alarm_tag *group_next; /**< Next alarm in the same group by id */
+  struct alarm_tag *group_prev; /**< Previous alarm in the same group by id */
+  _Atomic(struct display_slot *) owner; /**< Display slot printing the alarm,
+                                             set when it is inserted */
 } alarm_t;
 
+/** @brief Structure to store the alarms of one group, sorted by id */
+typedef struct alarm_group {
+  int group;                /**< Alarm group number */
+  int count;                /**< Number of alarms in the group */
+  alarm_t *alarms;          /**< First alarm of the group */
+  alarm_t *last;            /**< Last alarm of the group */
+  struct alarm_group *next; /**< Next group in the same table bucket */
+} alarm_group_t;
+
+/** @brief Copy of an alarm returned by the List commands */
+typedef struct alarm_summary {
+  int alarm_id;       /**< Unique identifier for the alarm */
+  int group;          /**< Alarm group number */
+  int seconds;        /**< Seconds (or period) of the alarm */
+  time_t expiration;  /**< Time the alarm (or its next period) expires at */
+  char message[128];  /**< Message associated with the alarm */
+} alarm_summary_t;
+
+/** @brief Number of alarms a display thread prints */
+#define DISPLAY_SLOTS 2
+
+/** @brief Structure to store one alarm assigned to a display thread */
+typedef struct display_slot {
+  struct display_alarm_info *context; /**< Display thread the slot belongs to */
+  int alarm_id;       /**< ID of the alarm assigned to the slot, -1 if empty */
+  int pending;        /**< Flag set until the alarm's owner is set to the slot */
+  int taken_over;     /**< Flag indicating the alarm was taken over */
+  char message[128];  /**< Message last printed for the alarm */
+} display_slot_t;
+
 /** @brief Structure to store information about display alarm threads */
 typedef struct display_alarm_info {
   pthread_t thread;           /**< Thread handling display of alarms */
   int alarm_group;            /**< Group number of alarms displayed by this thread */
   int alarms_in_group;        /**< Number of alarms in this group */
-  int alarm1;                 /**< ID of the first alarm assigned to this thread */
-  int alarm1_taken_over;      /**< Flag indicating if the first alarm was taken over */
-  char alarm1_message[128];   /**< Message associated with the first alarm */
-  int alarm2;                 /**< ID of the second alarm assigned to this thread */
-  int alarm2_taken_over;      /**< Flag indicating if the second alarm was taken over */
-  char alarm2_message[128];   /**< Message associated with the second alarm */
+  display_slot_t slot[DISPLAY_SLOTS]; /**< Alarms assigned to this thread */
+  atomic_int wakeup;          /**< Set to make the thread check its slots now */
   struct display_alarm_info *next; /**< Pointer to the next thread in the list */
 } display_alarm_info_t;
 
+/** @brief Sources of time the alarm engine can be driven by */
+typedef enum clock_source {
+  CLOCK_SOURCE_REAL,     /**< Wall clock: time(NULL), sleep and sem_timedwait */
+  CLOCK_SOURCE_SIMULATED /**< Virtual clock advanced whenever all threads wait */
+} clock_source_t;
+
+/** @brief Structure to store a thread blocked on the simulated clock */
+typedef struct clock_waiter {
+  time_t deadline;           /**< Virtual time at which the wait times out */
+  sem_t *sem;                /**< Semaphore that ends the wait early, or NULL */
+  atomic_int *word;          /**< Wakeup word that ends the wait early, or NULL */
+  int woken;                 /**< Flag set when sem was posted or word was set */
+  pthread_cond_t cond;       /**< Signaled when the wait may be over */
+  int heap_index;            /**< Position in the deadline heap, or -1 */
+  struct clock_waiter *next; /**< Next waiter in the same wakeup bucket, or
+                                  in the list of idle waiters */
+} clock_waiter_t;
+
+/** @brief Roles a thread can have, each with its own placement */
+typedef enum thread_role {
+  THREAD_ROLE_MONITOR, /**< The alarm monitor (expiry) thread */
+  THREAD_ROLE_DISPLAY, /**< Every display alarm thread */
+  THREAD_ROLE_INPUT,   /**< The main thread reading commands */
+  THREAD_ROLE_COUNT
+} thread_role_t;
+
+/** @brief Structure to store where and how threads of one role run */
+typedef struct thread_placement {
+  const char *name;  /**< Name of the role used on the command line */
+  cpu_set_t cpus;    /**< CPUs the threads are pinned to */
+  int cpus_set;      /**< Flag indicating cpus was configured */
+  char cpus_text[64]; /**< CPU list or NUMA node as given on the command line */
+  size_t stack_size; /**< Stack size for new threads, 0 for the default */
+  int priority;      /**< SCHED_FIFO priority, 0 for the default policy */
+} thread_placement_t;
+
+/** @brief Structure to store admission control limits and counters */
+typedef struct admission_control {
+  int max_alarms;          /**< Most alarms in the alarm list, 0 for no limit */
+  int max_pending_changes; /**< Most queued change requests, 0 for no limit */
+  int max_display_threads; /**< Most display threads, 0 for no limit */
+  int wait_seconds;        /**< Time to wait for a change slot before rejecting */
+  int pending_changes;     /**< Change requests waiting for the monitor,
+                                protected by changed_alarm_semaphore */
+  int display_threads;     /**< Display threads currently running, protected
+                                by display_list_semaphore */
+  atomic_long rejected_alarms;   /**< Alarms rejected because the list was full */
+  atomic_long rejected_changes;  /**< Change requests rejected because the
+                                      queue was full */
+  atomic_long rejected_displays; /**< Alarms or changes rejected for lack of a
+                                      display */
+} admission_control_t;
+
+// Admission limits, configured on the command line, and their counters
+admission_control_t admission = {0};
+
+/** @brief First bytes of a trace file, "ALMT" in little endian order */
+#define TRACE_MAGIC 0x544D4C41u
+
+/** @brief Version of the trace record layout */
+#define TRACE_VERSION 1
+
+/** @brief Header at the start of a trace file, in host byte order */
+typedef struct trace_header {
+  uint32_t magic;        /**< TRACE_MAGIC */
+  uint32_t version;      /**< TRACE_VERSION */
+  uint32_t clock_source; /**< clock_source_t of the recorded run */
+  uint32_t unused;       /**< Padding, always 0 */
+} trace_header_t;
+
+/** @brief Kinds of trace records */
+typedef enum trace_type {
+  TRACE_COMMAND = 1,      /**< Command line read by the main thread */
+  TRACE_INSERTED,         /**< Alarm inserted into the alarm list */
+  TRACE_REJECTED,         /**< Start request rejected */
+  TRACE_CHANGED,          /**< Change applied by the monitor thread */
+  TRACE_CHANGE_REJECTED,  /**< Change request rejected or invalid */
+  TRACE_FIRED,            /**< Period of a periodic alarm fired */
+  TRACE_REMOVED,          /**< Alarm expired and removed */
+  TRACE_TYPE_COUNT
+} trace_type_t;
+
+/**
+ * @brief Fixed part of a trace record, in host byte order.
+ *
+ * A command record is followed by length bytes of command text, an event
+ * record carries no text.
+ */
+typedef struct trace_record {
+  uint8_t type;       /**< One of trace_type_t */
+  uint8_t unused;     /**< Padding, always 0 */
+  uint16_t length;    /**< Number of text bytes following the record */
+  int32_t alarm_id;   /**< Alarm the event is about, -1 for commands */
+  int32_t group;      /**< Group of the alarm */
+  int32_t seconds;    /**< Seconds (or period) of the alarm */
+  int64_t time_ns;    /**< Engine clock time in nanoseconds */
+  int64_t expiration; /**< Scheduled expiration the event relates to */
+} trace_record_t;
+
+/** @brief Structure to store a trace loaded or captured in memory */
+typedef struct trace_log {
+  trace_record_t *records; /**< Records in the order they were written */
+  char **texts;            /**< Command text of each record, or NULL */
+  int count;               /**< Number of records */
+  int capacity;            /**< Number of records allocated */
+} trace_log_t;
+
+/** @brief Sort key of a trace event, used to match two traces */
+typedef struct trace_key {
+  int type;     /**< One of trace_type_t */
+  int alarm_id; /**< Alarm the event is about */
+  int index;    /**< Position of the event in its trace */
+} trace_key_t;
+
+// Mutex serializing the trace file and the captured trace
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+FILE *trace_file = NULL;    // Trace being recorded with --trace, or NULL
+int trace_capturing = 0;    // Set while a replay captures its own events
+trace_log_t trace_capture;  // Events of the run being replayed
+
+/** @brief Most concurrency levels a stress run can be given */
+#define STRESS_MAX_LEVELS 16
+
+/** @brief Structure to store one concurrency level of a stress run */
+typedef struct stress_level {
+  int producers; /**< Threads issuing Start_Alarm and Change_Alarm requests */
+  int displays;  /**< Display threads allowed, one group of alarms each */
+} stress_level_t;
+
+/** @brief Structure to store the state of one stress producer thread */
+typedef struct stress_producer {
+  pthread_t thread;   /**< Thread issuing the requests */
+  int index;          /**< Number of the producer within its level */
+  int ops;            /**< Number of requests to issue */
+  int batch;          /**< Requests issued per simulated second */
+  int groups;         /**< Alarm groups the requests are spread over */
+  int id_base;        /**< First alarm id owned by the producer */
+  int id_range;       /**< Number of alarm ids owned by the producer */
+  unsigned int seed;  /**< Random number state */
+  double *latencies;  /**< Wall time of each request in microseconds */
+  long display_errors; /**< Alarms without exactly one display of their group */
+  long index_errors;  /**< Inconsistencies found in the alarm indexes */
+  int peak_displays;  /**< Most display threads seen while running */
+  struct timespec finished; /**< Wall time the last request returned */
+} stress_producer_t;
+
+// Concurrency levels of a stress run, configured with --stress
+stress_level_t stress_levels[STRESS_MAX_LEVELS];
+int stress_level_count = 0;
+int stress_ops = 2000;          // Requests issued per concurrency level
+atomic_long stress_progress = 0; // Requests issued so far, for the watchdog
+
+atomic_long alarms_inserted = 0; // Alarms accepted into the alarm list
+atomic_long alarms_removed = 0;  // Alarms removed by the monitor thread
+
+// Placement of each thread role, configured with -p on the command line
+thread_placement_t thread_placements[THREAD_ROLE_COUNT] = {
+    {"monitor"}, {"display"}, {"input"}};
+cpu_set_t process_cpus; // CPUs the process ran on before any placement
+
+pthread_t monitor_thread; // Thread removing expired alarms
+pthread_t input_thread;   // Main thread reading commands
+
+// Clock every timing decision in the engine goes through
+clock_source_t clock_source = CLOCK_SOURCE_REAL;
+
+// Mutex protecting the simulated clock state below, each waiter has its own
+// condition so a wakeup only reaches the threads it concerns
+pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+_Atomic time_t virtual_now = 0;      // Current simulated time, only written
+                                     // with clock_mutex held
+// Waiters with a deadline, a binary min-heap ordered by deadline
+clock_waiter_t **clock_deadlines = NULL;
+int clock_deadline_count = 0;
+int clock_deadline_capacity = 0;
+// Waiters on a semaphore or wakeup word, hashed by its address
+clock_waiter_t *clock_wakeup_table[CLOCK_WAKEUP_TABLE_SIZE];
+// Waiters with neither a deadline nor anything to wake them, clock_wait_idle
+clock_waiter_t *clock_idle_waiters = NULL;
+int clock_participants = 0; // Threads whose progress the simulated clock tracks
+int clock_waiting = 0;      // Participants currently blocked in a clock wait
+int clock_idle = 0;         // Set when every participant waits with no deadline
+
 // List of display threads
 display_alarm_info_t *display_alarm_threads;
 
@@ -37,7 +284,17 @@ sem_t display_list_semaphore;    // Semaphore for display thread list
 sem_t alarm_write_semaphore;     // Semaphore to write to the alarm list
 sem_t alarm_read_semaphore;      // Semaphore to read from the alarm list
 sem_t changed_alarm_semaphore;  // Semaphore for changed alarm list
-sem_t monitor_semaphore;         // Semaphore for monitor thread to be signalled
+sem_t changed_slots_semaphore;   // Semaphore counting free change request slots
+
+// Wakeup word for the monitor thread, set to 1 when it has work and waited on
+// with a futex. Setting it when already set wakes nobody, so any number of
+// notifications before the monitor runs collapse into one wakeup.
+atomic_int monitor_wakeup = 0;
+// Deadline the monitor is currently waiting for, new alarms only wake it when
+// they expire before this
+_Atomic time_t monitor_deadline = CLOCK_NEVER;
+atomic_long monitor_notifications = 0; // Wakeups requested from the monitor
+atomic_long monitor_wakeups = 0;       // Times the monitor actually woke up
 
 alarm_t *alarm_list = NULL;       // Alarm List
 alarm_t *changed_alarm_list = NULL;  // Alarm Change list
@@ -45,6 +302,24 @@ alarm_t *changed_alarm_list = NULL;  // Alarm Change list
 // Count of threads reading the alarm list
 int reading_threads = 0;
 
+// Upper levels of the id skip list over alarm_list, level 0 is alarm_list
+// itself. Protected by the same semaphores as the alarm list.
+alarm_t *alarm_skip_head[ALARM_SKIP_LEVELS];
+unsigned int alarm_skip_seed = 2463534242u; // State for skip list level picks
+
+// Per-group alarm lists, hashed by group number, protected like the alarm list
+alarm_group_t *group_table[GROUP_TABLE_SIZE];
+
+// Deadline index, a binary min-heap of the alarms in alarm_list ordered by
+// expiration time, protected by the same semaphores as the alarm list
+alarm_t **deadline_heap = NULL;
+int deadline_heap_size = 0;
+int deadline_heap_capacity = 0;
+
+// Most periods a periodic alarm fires for at once after the monitor stalled,
+// further missed periods are skipped
+int max_catch_up = 1;
+
 /**
  * @brief Increments the count of threads reading the alarm list.
  *
@@ -61,13 +336,272 @@ void start_reading();
  */
 void stop_reading();
 
+/**
+ * @brief Parses a thread placement specification.
+ *
+ * The specification has the form
+ * role:cpus=LIST,node=N,stack=BYTES,priority=P where role is monitor, display
+ * or input, LIST is a CPU list such as 0-3,8 and node picks the CPUs of a
+ * NUMA node. Every key is optional.
+ *
+ * @param spec The specification given on the command line.
+ * @return 0 on success, -1 if the specification is invalid.
+ */
+int parse_thread_placement(const char *spec);
+
+/**
+ * @brief Creates a thread placed according to its role.
+ *
+ * Applies the role's CPU affinity, stack size and priority through the thread
+ * attributes. A role without CPUs or a priority of its own runs on the
+ * process's original CPUs under the default policy, whatever the creating
+ * thread was given. If the priority cannot be set (usually for lack of
+ * privileges) the thread is created again without it.
+ *
+ * @param thread Where to store the new thread's id.
+ * @param role The role of the new thread.
+ * @param start The thread function.
+ * @param arg The argument passed to the thread function.
+ * @return 0 on success, or the error returned by pthread_create.
+ */
+int create_placed_thread(pthread_t *thread, thread_role_t role,
+                         void *(*start)(void *), void *arg);
+
+/**
+ * @brief Applies the input role's affinity and priority to the main thread.
+ *
+ * Saves the CPUs the process may run on in process_cpus first, so the other
+ * roles are not placed with the input role's CPUs.
+ */
+void place_input_thread();
+
+/**
+ * @brief Prints engine statistics, including where each thread runs.
+ */
+void print_stats();
+
+/**
+ * @brief Finds an alarm by id using the skip list.
+ *
+ * Must be called while reading or writing the alarm list.
+ *
+ * @param alarm_id The id to look for.
+ * @return The alarm, or NULL if there is no alarm with that id.
+ */
+alarm_t *alarm_index_find(int alarm_id);
+
+/**
+ * @brief Finds the alarm with the smallest id not below a given id.
+ *
+ * Must be called while reading or writing the alarm list.
+ *
+ * @param alarm_id The smallest id to return.
+ * @return The alarm, or NULL if every alarm has a smaller id.
+ */
+alarm_t *alarm_index_lower_bound(int alarm_id);
+
+/**
+ * @brief Links an alarm into alarm_list and the skip list, sorted by id.
+ *
+ * Must be called with alarm_write_semaphore held.
+ *
+ * @param alarm A pointer to the alarm to link.
+ * @return 0 on success, -1 if an alarm with the same id already exists.
+ */
+int alarm_index_insert(alarm_t *alarm);
+
+/**
+ * @brief Unlinks an alarm from alarm_list and the skip list.
+ *
+ * Must be called with alarm_write_semaphore held.
+ *
+ * @param alarm A pointer to an alarm in the list.
+ */
+void alarm_index_remove(alarm_t *alarm);
+
+/**
+ * @brief Returns the per-group list of a group.
+ *
+ * Must be called while reading or writing the alarm list.
+ *
+ * @param group The alarm group number.
+ * @return The group's list, or NULL if the group has no alarms.
+ */
+alarm_group_t *group_index_find(int group);
+
+/**
+ * @brief Adds an alarm to the list of its group.
+ *
+ * Must be called with alarm_write_semaphore held.
+ *
+ * @param alarm A pointer to the alarm, its group must be set.
+ */
+void group_index_insert(alarm_t *alarm);
+
+/**
+ * @brief Removes an alarm from the list of its group.
+ *
+ * Must be called with alarm_write_semaphore held, before the alarm's group
+ * is changed.
+ *
+ * @param alarm A pointer to an alarm in its group's list.
+ */
+void group_index_remove(alarm_t *alarm);
+
+/**
+ * @brief Lists the alarms whose ids are in a range.
+ *
+ * Copies at most LIST_PAGE_SIZE alarms at a time while reading the alarm
+ * list and prints them after releasing it, so writers are never held off
+ * for the whole scan.
+ *
+ * @param first_id The smallest id to list.
+ * @param last_id The largest id to list.
+ */
+void list_alarms_by_id(int first_id, int last_id);
+
+/**
+ * @brief Lists the alarms of a group in id order, a page at a time.
+ *
+ * @param group The alarm group number.
+ */
+void list_alarms_by_group(int group);
+
+/**
+ * @brief Lists the alarms expiring within a number of seconds, earliest
+ * first, a page at a time.
+ *
+ * @param seconds The length of the window starting now.
+ */
+void list_alarms_by_deadline(int seconds);
+
+/**
+ * @brief Adds an alarm to the deadline heap.
+ *
+ * Must be called with alarm_write_semaphore held.
+ *
+ * @param alarm A pointer to the alarm, its expiration must be set.
+ */
+void deadline_heap_push(alarm_t *alarm);
+
+/**
+ * @brief Removes an alarm from the deadline heap.
+ *
+ * Must be called with alarm_write_semaphore held.
+ *
+ * @param alarm A pointer to an alarm currently in the heap.
+ */
+void deadline_heap_remove(alarm_t *alarm);
+
+/**
+ * @brief Restores the heap order after an alarm's expiration changed.
+ *
+ * The alarm keeps its heap slot and is moved up or down in place, so
+ * re-arming or changing an alarm does not reallocate anything. Must be
+ * called with alarm_write_semaphore held.
+ *
+ * @param alarm A pointer to an alarm currently in the heap.
+ */
+void deadline_heap_update(alarm_t *alarm);
+
+/**
+ * @brief Returns the current time of the engine clock.
+ *
+ * Returns time(NULL) when running on the real clock and the virtual time when
+ * running in simulation mode.
+ */
+time_t clock_now();
+
+/**
+ * @brief Sleeps for a number of seconds on the engine clock.
+ *
+ * @param seconds The number of seconds to sleep.
+ */
+void clock_sleep(int seconds);
+
+/**
+ * @brief Waits on a semaphore until it is posted or a deadline passes.
+ *
+ * The deadline is an absolute time on the engine clock, CLOCK_NEVER waits
+ * until the semaphore is posted. In simulation mode the semaphore must be
+ * posted with clock_post so the clock knows the waiter became runnable.
+ *
+ * @param sem The semaphore to wait on.
+ * @param deadline The absolute time at which to give up waiting.
+ * @return 0 if the semaphore was taken, ETIMEDOUT if the deadline passed.
+ */
+int clock_timedwait(sem_t *sem, time_t deadline);
+
+/**
+ * @brief Waits until a wakeup word is set or a deadline passes.
+ *
+ * Uses a futex on the real clock. The word is cleared when the wait returns
+ * because it was set, so the next wait blocks until the word is set again.
+ *
+ * @param word The wakeup word to wait on.
+ * @param deadline The absolute time at which to give up waiting.
+ * @return 0 if the word was set, ETIMEDOUT if the deadline passed.
+ */
+int clock_futex_wait(atomic_int *word, time_t deadline);
+
+/**
+ * @brief Sets a wakeup word and wakes the thread waiting on it.
+ *
+ * Only the call that sets the word from 0 to 1 wakes the waiter, later calls
+ * before the waiter runs cost a single atomic exchange.
+ *
+ * @param word The wakeup word to set.
+ */
+void clock_futex_wake(atomic_int *word);
+
+/**
+ * @brief Wakes the monitor thread.
+ *
+ * Changes always need the monitor, new alarms only need it when they expire
+ * before the deadline it is currently waiting for.
+ *
+ * @param expiration Expiration time of a new alarm, or 0 for a change request.
+ */
+void notify_monitor(time_t expiration);
+
+/**
+ * @brief Posts a semaphore that may have a thread blocked in clock_timedwait.
+ *
+ * @param sem The semaphore to post.
+ */
+void clock_post(sem_t *sem);
+
+/**
+ * @brief Registers one more thread whose waits drive the simulated clock.
+ *
+ * Called by the creating thread before pthread_create so the clock cannot
+ * advance before the new thread gets to run.
+ */
+void clock_join();
+
+/**
+ * @brief Unregisters the calling thread from the simulated clock.
+ */
+void clock_leave();
+
+/**
+ * @brief Waits until every other thread is idle with no pending deadline.
+ *
+ * Only meaningful in simulation mode, where it is used to drain the engine
+ * once the input has been consumed.
+ */
+void clock_wait_idle();
+
 /**
  * @brief The display alarm thread function that displays alarms in its group.
  *
  * This function is responsible for displaying alarms associated with a specific
  * group number. It checks for alarms in the specified
  * group and assigned to the specific thread and displays them at 5 second increments.
+ * A slot is printed only while its alarm's owner is that slot, and the thread
+ * checks its slots at once when it is notified that an owner changed.
  *
+ * @param args The display_alarm_info_t of the thread.
  */
 void *display_alarm(void *args);
 
@@ -77,7 +611,8 @@ void *display_alarm(void *args);
  * This function serves as the monitor thread, continuously checking for changed
  * alarms and expired alarms. It processes changes in alarms, updates alarm
  * information, and finds the nearest alarm for expiration. The thread sleeps
- * until the next nearest alarm or until a change is signaled.
+ * on monitor_wakeup until the next nearest alarm or until a change or an
+ * earlier alarm is signaled.
  *
  */
 void *monitor_alarms(void *args);
@@ -88,7 +623,9 @@ void *monitor_alarms(void *args);
  * Checks for alarms that have expired based on their set time and duration.
  * Removes expired alarms from the alarm list and prints information about
  * the removed alarms. It also frees memory associated with expired alarms.
- * This function is called periodically by the monitor thread to manage
+ * Periodic alarms with periods left are instead re-armed in place for their
+ * next period, computed from their base time so they never drift. This
+ * function is called periodically by the monitor thread to manage
  * alarm expiration.
  *
  */
@@ -98,7 +635,9 @@ void process_expired_alarms();
  * @brief Inserts a change alarm request into the changed alarm list.
  *
  * Inserts a changed alarm into the list of changed alarms to be updated and signals the
- * monitor thread to process these changes.
+ * monitor thread to process these changes. If the list holds the maximum number
+ * of pending changes, waits up to the admission wait time for the monitor to
+ * make room and otherwise rejects (and frees) the request.
  *
  * @param alarm A pointer to the alarm structure with the modified data.
  */
@@ -109,21 +648,170 @@ void insert_alarm_changed(alarm_t *alarm);
  *
  * Checks if a display thread exists for the alarm's group. If it does, the
  * alarm is assigned to an available thread. If not, a new thread is created for
- * the group.
+ * the group, unless the maximum number of display threads is running.
+ * The slot is reserved as pending: the caller sets the alarm's owner to it
+ * and then calls publish_display_slot. Only the display list semaphore is
+ * taken, so it must be called without the alarm list locked.
  *
  * @param alarm A pointer to the alarm structure thats needs to be displayed.
  * @param taken_over An indicator whether the alarm would be taken over by
  * another thread.
+ * @return The reserved slot, or NULL if none could be assigned.
+ */
+display_slot_t *check_or_create_display_thread(alarm_t *alarm,
+                                               int taken_over);
+
+/**
+ * @brief Ends the reservation of a display slot.
+ *
+ * If the alarm's owner was set to the slot, the slot becomes active,
+ * otherwise it is emptied again. Either way its display thread is notified.
+ *
+ * @param slot The slot returned by check_or_create_display_thread.
+ * @param claimed Whether the alarm's owner was set to the slot.
+ */
+void publish_display_slot(display_slot_t *slot, int claimed);
+
+/**
+ * @brief Makes a display thread check its slots without waiting.
+ *
+ * @param context The display thread to notify.
  */
-void check_or_create_display_thread(alarm_t *alarm, int taken_over);
+void notify_display_thread(display_alarm_info_t *context);
 
 /**
  * @brief Inserts a new alarm into the list of alarms.
  *
  * Inserts a new alarm into the list of alarms sorted by the alarm ID. It
  * signals the monitor thread about the new alarm and checks or creates a
- * display thread for it.
+ * display thread for it. The alarm is rejected (and freed) if the list holds
+ * the maximum number of alarms or no display thread can be assigned to it.
+ * The display slot is reserved before the alarm is inserted, so a rejected
+ * alarm never appears in the list.
  *
  * @param alarm A pointer to the new alarm structure to be inserted.
  */
 void insert_alarm(alarm_t *alarm);
+
+/**
+ * @brief Waits until every alarm that can expire has expired.
+ *
+ * Called by the main thread once its input has ended. Pending change
+ * requests are applied first. Periodic alarms without a repeat count never
+ * expire, so the wait ends once only those are left.
+ *
+ * @return The number of periodic alarms without a repeat count left.
+ */
+int drain_alarms();
+
+/**
+ * @brief Delays a replayed command until its captured time.
+ *
+ * Commands replayed from a captured log are reissued with the same spacing
+ * they had when the log was written. The first replayed command is issued
+ * immediately and sets the offset between the log and the engine clock.
+ *
+ * @param logged_time The time stamp the command carries in the log.
+ */
+void replay_wait_until(time_t logged_time);
+
+/**
+ * @brief Checks the alarm list, its indexes and the display assignments.
+ *
+ * Verifies that the skip list, the group lists and the deadline heap all hold
+ * exactly the alarms in alarm_list, and counts alarms that have no owner or
+ * whose owner is not a display slot of their group holding them. Only the
+ * alarm list is locked.
+ *
+ * @param display_errors Incremented for each alarm without a valid owner.
+ * @param index_errors Incremented for each inconsistency in the indexes.
+ */
+void check_engine_invariants(long *display_errors, long *index_errors);
+
+/**
+ * @brief Parses the concurrency levels of a stress run.
+ *
+ * @param spec A comma separated list of producers:displays pairs.
+ * @return 0 on success, -1 if the list is invalid.
+ */
+int parse_stress_levels(const char *spec);
+
+/**
+ * @brief Issues a producer's randomized Start_Alarm and Change_Alarm requests.
+ *
+ * @param args A pointer to the producer's stress_producer_t.
+ */
+void *stress_producer(void *args);
+
+/**
+ * @brief Runs every configured stress level and reports the results.
+ *
+ * Runs on the simulated clock with the event log discarded. For each level
+ * the producers run concurrently with the monitor and display threads, then
+ * the engine is drained and checked: every accepted alarm must have been
+ * removed by the monitor, and the indexes and display assignments must be
+ * consistent throughout. Throughput and request latency are printed per
+ * level on stderr.
+ *
+ * @return 0 if every level passed, 1 otherwise.
+ */
+int run_stress();
+
+/**
+ * @brief Checks the values of a parsed alarm or change request.
+ *
+ * Prints a message on stderr for each invalid value: a negative alarm id,
+ * group or repeat count, or a time (the period, for a periodic alarm) that
+ * is not positive.
+ *
+ * @param alarm The alarm as parsed from a command or a replayed log line.
+ * @return 1 if every value is valid, 0 otherwise.
+ */
+int validate_alarm(const alarm_t *alarm);
+
+/**
+ * @brief Parses and runs one command line.
+ *
+ * @param line The command, as read by the main thread or from a trace.
+ */
+void process_command(char *line);
+
+/**
+ * @brief Starts recording commands and engine events to a trace file.
+ *
+ * @param path The file to write.
+ * @return 0 on success, -1 if the file cannot be created.
+ */
+int trace_open(const char *path);
+
+/**
+ * @brief Records a command line read by the main thread.
+ *
+ * @param line The command line.
+ */
+void trace_command(const char *line);
+
+/**
+ * @brief Records an engine event about an alarm.
+ *
+ * Does nothing unless a trace is being recorded or a replay is running.
+ *
+ * @param type The kind of event.
+ * @param alarm The alarm the event is about.
+ * @param expiration The scheduled expiration the event relates to.
+ */
+void trace_event(trace_type_t type, alarm_t *alarm, time_t expiration);
+
+/**
+ * @brief Reissues the commands of a trace and compares the outcome.
+ *
+ * Commands are reissued with their recorded spacing, which takes the recorded
+ * time on the real clock and no time at all in simulation mode. Once the
+ * engine is idle, the events of the replay are matched with the recorded ones
+ * by kind, alarm and occurrence, and their timing relative to the first
+ * command and their lateness against the scheduled expiration are compared.
+ *
+ * @param path The trace file to replay.
+ * @return 0 if every event was reproduced on time, 1 otherwise.
+ */
+int run_replay(const char *path);